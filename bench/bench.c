@@ -0,0 +1,315 @@
+/* Microbenchmark suite for the hashmap.
+ *
+ * Workloads are generated from fixed seeds so runs are reproducible and
+ * comparable across commits. Each benchmark is run for several repetitions
+ * after a warmup pass and reports ns/op as min / p50 / p90 / max across the
+ * repetitions. On Linux, building with -DBENCH_PERF_COUNTERS=1 additionally
+ * samples hardware cache-miss and branch-miss counters around the timed
+ * loop (needs perf_event_open access, see /proc/sys/kernel/perf_event_paranoid).
+ *
+ * Usage: ./bench [keys] [ops]
+ *   keys  number of distinct keys per workload (default 100000)
+ *   ops   operations per repetition          (default 1000000)
+ */
+#include "../src/include/hashmap.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef BENCH_PERF_COUNTERS
+#define BENCH_PERF_COUNTERS 0
+#endif
+
+#if BENCH_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_SEED        0x9e3779b97f4a7c15ULL
+#define BENCH_WARMUP      1
+#define BENCH_REPETITIONS 7
+#define BENCH_KEY_LEN     24
+#define BENCH_ZIPF_S      0.99
+
+static size_t _nkeys = 100000;
+static size_t _nops = 1000000;
+
+/* splitmix64, fixed-seed PRNG driving every generator */
+typedef struct {
+  uint64_t state;
+} BenchRng;
+
+static uint64_t _rng_next(BenchRng *rng) {
+  uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* zipfian index in [0, n) via rejection-inversion, s = BENCH_ZIPF_S */
+typedef struct {
+  size_t n;
+  double hx0;
+  double hxn;
+  double q;
+} BenchZipf;
+
+static double _zipf_h(double x) {
+  return exp((1.0 - BENCH_ZIPF_S) * log(1.0 + x)) / (1.0 - BENCH_ZIPF_S);
+}
+
+static double _zipf_hinv(double x) {
+  return exp(log((1.0 - BENCH_ZIPF_S) * x) / (1.0 - BENCH_ZIPF_S)) - 1.0;
+}
+
+static void _zipf_init(BenchZipf *zipf, size_t n) {
+  zipf->n = n;
+  zipf->hx0 = _zipf_h(0.5) - 1.0;
+  zipf->hxn = _zipf_h((double)n + 0.5);
+  zipf->q = 2.0 - _zipf_hinv(_zipf_h(1.5) - 1.0);
+}
+
+static size_t _zipf_next(BenchZipf *zipf, BenchRng *rng) {
+  for (;;) {
+    double u = (double)(_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+    double x = zipf->hx0 + u * (zipf->hxn - zipf->hx0);
+    double k = floor(_zipf_hinv(x) + 0.5);
+    if (k < 1.0) {
+      k = 1.0;
+    }
+    if (k > (double)zipf->n) {
+      k = (double)zipf->n;
+    }
+    if (k - x <= zipf->q || x >= _zipf_h(k + 0.5) - 1.0) {
+      return (size_t)k - 1;
+    }
+  }
+}
+
+static char *_keys = NULL;
+
+static const char *_key(size_t i) {
+  return _keys + i * BENCH_KEY_LEN;
+}
+
+static void _make_keys(void) {
+  _keys = malloc(_nkeys * BENCH_KEY_LEN);
+  if (_keys == NULL) {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t i = 0;
+  for (i = 0; i < _nkeys; i++) {
+    snprintf(_keys + i * BENCH_KEY_LEN, BENCH_KEY_LEN, "bench_key_%zu", i);
+  }
+}
+
+static uint64_t _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#if BENCH_PERF_COUNTERS
+static int _perf_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int _perf_cache = -1;
+static int _perf_branch = -1;
+
+static void _perf_start(void) {
+  if (_perf_cache == -1) {
+    _perf_cache = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    _perf_branch = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  }
+  if (_perf_cache >= 0) {
+    ioctl(_perf_cache, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_perf_cache, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  if (_perf_branch >= 0) {
+    ioctl(_perf_branch, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_perf_branch, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+static void _perf_stop(uint64_t *cache_misses, uint64_t *branch_misses) {
+  *cache_misses = 0;
+  *branch_misses = 0;
+  if (_perf_cache >= 0) {
+    ioctl(_perf_cache, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(_perf_cache, cache_misses, sizeof(*cache_misses)) <= 0) {
+      *cache_misses = 0;
+    }
+  }
+  if (_perf_branch >= 0) {
+    ioctl(_perf_branch, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(_perf_branch, branch_misses, sizeof(*branch_misses)) <= 0) {
+      *branch_misses = 0;
+    }
+  }
+}
+#endif
+
+typedef uint64_t (*BenchWorkload)(HashMap *map, BenchRng *rng);
+
+static int _cmp_double(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static void _run(const char *name, BenchWorkload workload) {
+  double ns_per_op[BENCH_REPETITIONS];
+  uint64_t cache_misses = 0;
+  uint64_t branch_misses = 0;
+  int rep = 0;
+  for (rep = -BENCH_WARMUP; rep < BENCH_REPETITIONS; rep++) {
+    HashMap *map = hashmap_create(_nkeys, NULL, NULL);
+    if (map == NULL) {
+      fprintf(stderr, "bench: hashmap_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+    /* every repetition replays the same operation stream */
+    BenchRng rng = {BENCH_SEED};
+#if BENCH_PERF_COUNTERS
+    _perf_start();
+#endif
+    uint64_t start = _now_ns();
+    uint64_t ops = workload(map, &rng);
+    uint64_t elapsed = _now_ns() - start;
+#if BENCH_PERF_COUNTERS
+    _perf_stop(&cache_misses, &branch_misses);
+#endif
+    hashmap_destroy(map);
+    if (rep >= 0) {
+      ns_per_op[rep] = (double)elapsed / (double)ops;
+    }
+  }
+  qsort(ns_per_op, BENCH_REPETITIONS, sizeof(*ns_per_op), _cmp_double);
+  printf("%-28s min %7.2f  p50 %7.2f  p90 %7.2f  max %7.2f ns/op",
+         name, ns_per_op[0], ns_per_op[BENCH_REPETITIONS / 2],
+         ns_per_op[(BENCH_REPETITIONS * 9) / 10],
+         ns_per_op[BENCH_REPETITIONS - 1]);
+  if (cache_misses > 0 || branch_misses > 0) {
+    printf("  cache-miss/op %5.2f  branch-miss/op %5.2f",
+           (double)cache_misses / (double)_nops,
+           (double)branch_misses / (double)_nops);
+  }
+  printf("\n");
+}
+
+static void _fill(HashMap *map) {
+  size_t i = 0;
+  for (i = 0; i < _nkeys; i++) {
+    hashmap_set(map, _key(i), _keys);
+  }
+}
+
+static uint64_t _bench_set_fresh(HashMap *map, BenchRng *rng) {
+  (void)rng;
+  size_t i = 0;
+  for (i = 0; i < _nops; i++) {
+    hashmap_set(map, _key(i % _nkeys), _keys);
+  }
+  return _nops;
+}
+
+/* sink keeps the compiler from discarding the timed lookups */
+static volatile const void *_sink;
+
+static uint64_t _bench_get_uniform(HashMap *map, BenchRng *rng) {
+  _fill(map);
+  size_t i = 0;
+  for (i = 0; i < _nops; i++) {
+    _sink = hashmap_get(map, _key(_rng_next(rng) % _nkeys));
+  }
+  return _nops;
+}
+
+static uint64_t _bench_get_zipfian(HashMap *map, BenchRng *rng) {
+  _fill(map);
+  BenchZipf zipf;
+  _zipf_init(&zipf, _nkeys);
+  size_t i = 0;
+  for (i = 0; i < _nops; i++) {
+    _sink = hashmap_get(map, _key(_zipf_next(&zipf, rng)));
+  }
+  return _nops;
+}
+
+static uint64_t _bench_get_miss(HashMap *map, BenchRng *rng) {
+  _fill(map);
+  char key[BENCH_KEY_LEN];
+  size_t i = 0;
+  for (i = 0; i < _nops; i++) {
+    snprintf(key, sizeof(key), "miss_%" PRIu64, _rng_next(rng));
+    _sink = hashmap_get(map, key);
+  }
+  return _nops;
+}
+
+static uint64_t _bench_mixed_90_10(HashMap *map, BenchRng *rng) {
+  _fill(map);
+  size_t i = 0;
+  for (i = 0; i < _nops; i++) {
+    size_t k = _rng_next(rng) % _nkeys;
+    if ((_rng_next(rng) % 10) == 0) {
+      hashmap_set(map, _key(k), _keys);
+    } else {
+      _sink = hashmap_get(map, _key(k));
+    }
+  }
+  return _nops;
+}
+
+/* insert/delete pairs keep the map near its load-factor boundaries and
+ * exercise the grow and shrink paths */
+static uint64_t _bench_churn(HashMap *map, BenchRng *rng) {
+  _fill(map);
+  size_t i = 0;
+  for (i = 0; i < _nops / 2; i++) {
+    size_t k = _rng_next(rng) % _nkeys;
+    hashmap_delete(map, _key(k), NULL);
+    hashmap_set(map, _key(k), _keys);
+  }
+  return _nops;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    _nkeys = strtoull(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    _nops = strtoull(argv[2], NULL, 10);
+  }
+  if (_nkeys == 0 || _nops == 0) {
+    fprintf(stderr, "usage: %s [keys] [ops]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  _make_keys();
+  printf("bench: %zu keys, %zu ops, %d repetitions (seed %#" PRIx64 ")\n\n",
+         _nkeys, _nops, BENCH_REPETITIONS, (uint64_t)BENCH_SEED);
+  _run("set (fresh + update)", _bench_set_fresh);
+  _run("get uniform (hit)", _bench_get_uniform);
+  _run("get zipfian s=0.99", _bench_get_zipfian);
+  _run("get uniform (miss)", _bench_get_miss);
+  _run("mixed 90% get / 10% set", _bench_mixed_90_10);
+  _run("churn delete+reinsert", _bench_churn);
+  free(_keys);
+  return EXIT_SUCCESS;
+}
@@ -2,7 +2,22 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef HASH_MAP_BUCKET_SIZE
 #define HASH_MAP_BUCKET_SIZE 8
@@ -10,276 +25,2763 @@
 #ifndef HASH_MAP_LOAD_FACTOR
 #define HASH_MAP_LOAD_FACTOR 0.75
 #endif
+#ifndef HASH_MAP_DEFAULT_STRIPES
+#define HASH_MAP_DEFAULT_STRIPES 64
+#endif
+/* batch lookups run through a fixed window so the prefetches stay within
+ * what the load buffers can track */
+#ifndef HASH_MAP_BATCH_WINDOW
+#define HASH_MAP_BATCH_WINDOW 64
+#endif
+/* slots scanned per operation while an incremental bucket migration is in
+ * progress */
+#ifndef HASH_MAP_MIGRATE_STEP
+#define HASH_MAP_MIGRATE_STEP 16
+#endif
+/* size of the mmap'd chunks bucket arrays are carved from in arena mode */
+#ifndef HASH_MAP_ARENA_CHUNK_SIZE
+#define HASH_MAP_ARENA_CHUNK_SIZE (1 << 20)
+#endif
+/* hugepage size the map block is rounded to when the config asks for
+ * hugepage backing, 2MB on x86-64 and most arm64 configurations */
+#ifndef HASH_MAP_HUGE_PAGE_SIZE
+#define HASH_MAP_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#endif
+/* primary-table buckets migrated per operation while a table extension is
+ * in progress, see hashmap_extend */
+#ifndef HASH_MAP_EXTEND_STEP
+#define HASH_MAP_EXTEND_STEP 1
+#endif
+/* hashmap_stats flags buckets holding more than this multiple of the mean
+ * as overloaded, see HashMapConfig.overload_factor */
+#ifndef HASH_MAP_OVERLOAD_FACTOR
+#define HASH_MAP_OVERLOAD_FACTOR 8
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(p) __builtin_prefetch((p))
+#else
+#define PREFETCH(p)
+#endif
 
 #define KEY_EQU(a, b) (((a).pkey == (b).pkey) && ((a).skey == (b).skey))
 
+/* bucket capacities must stay powers of two so probes can index with a
+ * mask instead of an integer division */
+#if (HASH_MAP_BUCKET_SIZE & (HASH_MAP_BUCKET_SIZE - 1)) != 0
+#error "HASH_MAP_BUCKET_SIZE must be a power of two"
+#endif
+#if HASH_MAP_BUCKET_INLINE > 0 &&                                              \
+    (HASH_MAP_BUCKET_INLINE & (HASH_MAP_BUCKET_INLINE - 1)) != 0
+#error "HASH_MAP_BUCKET_INLINE must be a power of two"
+#endif
+
+#define CTRL_EMPTY 0
+/* slot freed by a delete: probes walk through it, inserts reuse it and
+ * compaction reclaims it. Never has the occupied bit (0x80) set, never
+ * equal to CTRL_EMPTY */
+#define CTRL_TOMB 1
+
+/* a bucket is worth compacting once more than 1/HASH_MAP_TOMB_RATIO of its
+ * slots are tombstones, see hashmap_compact */
+#ifndef HASH_MAP_TOMB_RATIO
+#define HASH_MAP_TOMB_RATIO 4
+#endif
+
+/* the slot holds a live item (occupied bit of the control byte) */
+static bool _ctrl_live(uint8_t ctrl) {
+  return (ctrl & 0x80) != 0;
+}
+
+/* smallest power of two >= v */
+static size_t _round_up_pow2(size_t v) {
+  size_t p = 1;
+  while (p < v) {
+    p <<= 1;
+  }
+  return p;
+}
+
+/* Built-in hash, used when a map is created with a NULL hash function. A
+ * wyhash-style mixer: calls to it are direct, so _compute_key inlines it
+ * instead of paying an indirect branch per operation, and keys of up to 16
+ * bytes take a loop-free path of two overlapping reads. */
+static inline uint64_t _hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  /* 64x64 -> 128 multiply from 32-bit halves */
+  uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  return lo ^ hi;
+#endif
+}
+
+static inline uint64_t _hash_read64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t _hash_read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint64_t _builtin_hash(const char *key, size_t len,
+                              uint64_t map_seed) {
+  const uint64_t s0 = 0xa0761d6478bd642fULL;
+  const uint64_t s1 = 0xe7037ed1a0b428dbULL;
+  const uint64_t s2 = 0x8ebc6af09c88c6e3ULL;
+  const uint64_t s3 = 0x589965cc75374cc3ULL;
+  /* folding the per-map seed into the initial state is free and leaves the
+   * unseeded (map_seed 0) output unchanged */
+  uint64_t seed = s0 ^ map_seed;
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (len <= 16) {
+    if (len >= 4) {
+      /* overlapping reads cover 4..16 bytes without a byte loop */
+      a = (_hash_read32(key) << 32) | _hash_read32(key + ((len >> 3) << 2));
+      b = (_hash_read32(key + len - 4) << 32) |
+          _hash_read32(key + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)(uint8_t)key[0] << 16) |
+          ((uint64_t)(uint8_t)key[len >> 1] << 8) | (uint8_t)key[len - 1];
+    }
+  } else {
+    size_t i = len;
+    const char *p = key;
+    if (i > 48) {
+      uint64_t see1 = seed;
+      uint64_t see2 = seed;
+      do {
+        seed = _hash_mix(_hash_read64(p) ^ s1, _hash_read64(p + 8) ^ seed);
+        see1 = _hash_mix(_hash_read64(p + 16) ^ s2,
+                         _hash_read64(p + 24) ^ see1);
+        see2 = _hash_mix(_hash_read64(p + 32) ^ s3,
+                         _hash_read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = _hash_mix(_hash_read64(p) ^ s1, _hash_read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = _hash_read64(p + i - 16);
+    b = _hash_read64(p + i - 8);
+  }
+  return _hash_mix(s1 ^ len, _hash_mix(a ^ s1, b ^ seed));
+}
+
+/* 7 hash bits stored in the control byte, high bit set to mark the slot
+ * occupied so it can never compare equal to CTRL_EMPTY or CTRL_TOMB */
+static uint8_t _h2(HashMapBucketKey key) {
+  return (uint8_t)(0x80 | (key.skey >> 25));
+}
+
+/* control arrays are retired like item arrays in read-mostly mode and
+ * recycled like item arrays in arena mode, both of which chain through
+ * their first word, so never allocate fewer than 8 bytes */
+static size_t _ctrl_size(size_t capacity) {
+  return capacity < sizeof(void *) ? sizeof(void *) : capacity;
+}
+
+/* Arena allocator: blocks are carved from mmap'd chunks with a bump
+ * pointer and recycled through one free list per power-of-two size, so
+ * bucket grow/shrink never touches malloc and destroy is a few munmaps. */
+static size_t _arena_class(size_t size) {
+  size_t class = 3; /* 8 bytes, the smallest block a free list can chain */
+  while (((size_t)1 << class) < size) {
+    class++;
+  }
+  return class;
+}
+
+static void _arena_lock(HashMap *map) {
+  if (map->locks) {
+    pthread_mutex_lock(&map->_arena_lock);
+  }
+}
+
+static void _arena_unlock(HashMap *map) {
+  if (map->locks) {
+    pthread_mutex_unlock(&map->_arena_lock);
+  }
+}
+
+/* returns zeroed memory, like calloc */
+static void *_arena_alloc(HashMap *map, size_t size) {
+  size_t class = _arena_class(size);
+  size = (size_t)1 << class;
+  _arena_lock(map);
+  void *block = map->_arena_free[class];
+  if (block != NULL) {
+    map->_arena_free[class] = *(void **)block;
+    _arena_unlock(map);
+    memset(block, 0, size);
+    return block;
+  }
+  HashMapArenaChunk *chunk = map->_arena_chunks;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    size_t chunk_size = HASH_MAP_ARENA_CHUNK_SIZE;
+    if (chunk_size < size + sizeof(*chunk)) {
+      chunk_size = _round_up_pow2(size + sizeof(*chunk));
+    }
+    chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      _arena_unlock(map);
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (map->config.huge_pages) {
+      madvise(chunk, chunk_size, MADV_HUGEPAGE);
+    }
+#endif
+    chunk->next = map->_arena_chunks;
+    chunk->size = chunk_size;
+    chunk->used = sizeof(*chunk);
+    map->_arena_chunks = chunk;
+  }
+  /* fresh mmap'd memory is already zeroed */
+  block = (char *)chunk + chunk->used;
+  chunk->used += size;
+  _arena_unlock(map);
+  return block;
+}
+
+static void _arena_recycle(HashMap *map, void *block, size_t size) {
+  size_t class = _arena_class(size);
+  _arena_lock(map);
+  *(void **)block = map->_arena_free[class];
+  map->_arena_free[class] = block;
+  _arena_unlock(map);
+}
+
+/* every bucket array allocation and release funnels through these, so the
+ * arena stays an implementation detail of the call sites */
+static HashMapBucketItem *_items_alloc(HashMap *map, size_t capacity) {
+  if (map->use_arena) {
+    return _arena_alloc(map, capacity * sizeof(HashMapBucketItem));
+  }
+  return calloc(capacity, sizeof(HashMapBucketItem));
+}
+
+static void _items_free(HashMap *map, HashMapBucketItem *items,
+                        size_t capacity) {
+  if (map->use_arena) {
+    _arena_recycle(map, items, capacity * sizeof(HashMapBucketItem));
+    return;
+  }
+  free(items);
+}
+
+static uint8_t *_ctrl_alloc(HashMap *map, size_t capacity) {
+  if (map->use_arena) {
+    return _arena_alloc(map, _ctrl_size(capacity));
+  }
+  return calloc(_ctrl_size(capacity), 1);
+}
+
+static void _ctrl_free(HashMap *map, uint8_t *ctrl, size_t capacity) {
+  if (map->use_arena) {
+    _arena_recycle(map, ctrl, _ctrl_size(capacity));
+    return;
+  }
+  free(ctrl);
+}
+
+#if HASH_MAP_BUCKET_INLINE > 0
+static bool _bucket_inline(HashMapBucket *node) {
+  return node->items == node->inline_items;
+}
+#else
+static bool _bucket_inline(HashMapBucket *node) {
+  (void)node;
+  return false;
+}
+#endif
+
+/* true when the pointer lives inside the snapshot mapping of a loaded map:
+ * such memory must never be realloc'd or freed, only munmap'd at destroy */
+static bool _in_snapshot(HashMap *map, const void *p) {
+  return map->_snap_base != NULL && p >= map->_snap_base &&
+         p < (const void *)((const char *)map->_snap_base + map->_snap_size);
+}
+
 /* Private function */
+static void _lock_key(HashMap *map, HashMapBucketKey key) {
+  if (map->locks) {
+    pthread_mutex_lock(&map->locks[(key.pkey & map->mask) % map->lock_count]);
+  }
+}
+
+static void _unlock_key(HashMap *map, HashMapBucketKey key) {
+  if (map->locks) {
+    pthread_mutex_unlock(&map->locks[(key.pkey & map->mask) % map->lock_count]);
+  }
+}
+
+static void _lock_bucket_index(HashMap *map, size_t index) {
+  if (map->locks) {
+    pthread_mutex_lock(&map->locks[index % map->lock_count]);
+  }
+}
+
+static void _unlock_bucket_index(HashMap *map, size_t index) {
+  if (map->locks) {
+    pthread_mutex_unlock(&map->locks[index % map->lock_count]);
+  }
+}
+
+/* In concurrent mode the shared map->_tmp scratch buffer would race between
+ * stripes, so resize helpers take a private buffer instead. */
+static HashMapBucketItem *_get_scratch(HashMap *map, size_t capacity) {
+  if (map->locks) {
+    return calloc(capacity, sizeof(*map->_tmp));
+  }
+  if (map->_tmp_capacity < capacity) {
+    void *tmp2 = realloc(map->_tmp, capacity * sizeof(*map->_tmp));
+    if (!tmp2) {
+      return NULL;
+    }
+    map->_tmp = tmp2;
+    map->_tmp_capacity = capacity;
+  }
+  return map->_tmp;
+}
+
+static void _release_scratch(HashMap *map, HashMapBucketItem *scratch) {
+  if (map->locks) {
+    free(scratch);
+  }
+}
+
+/* Seqlock write side, pattern after the Linux kernel seqcount: bump to odd
+ * before mutating, back to even after, with store ordering fences so a
+ * lock-free reader either sees a stable bucket or retries. No-op outside
+ * read-mostly mode. */
+static void _write_begin(HashMap *map, HashMapBucket *node) {
+  if (!map->read_mostly) {
+    return;
+  }
+  __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void _write_end(HashMap *map, HashMapBucket *node) {
+  if (!map->read_mostly) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+}
+
+/* A retired array may still be probed by an in-flight reader, so it is
+ * chained through its first word instead of freed; the seqlock retry
+ * discards whatever such a reader saw. Reclaimed in hashmap_quiesce. */
+static void _retire(HashMap *map, void *array) {
+  pthread_mutex_lock(&map->_retired_lock);
+  *(void **)array = map->_retired_head;
+  map->_retired_head = array;
+  pthread_mutex_unlock(&map->_retired_lock);
+}
+
+/* true when the item holds the searched key. The 64-bit compare acts as a
+ * filter; in verified mode (and when the caller has the key bytes) the
+ * stored key is memcmp'd to rule out full-hash collisions. */
+static bool _item_matches(HashMap *map, HashMapBucketItem *item,
+                          HashMapBucketKey key, const char *kstr,
+                          size_t klen) {
+  /* a NULL data only marks an empty slot when values are pointers; in an
+   * inline-value map an all-zero value is legal and the control bytes are
+   * the only occupancy authority */
+  if ((map->value_size == 0 && item->data == NULL) ||
+      !KEY_EQU(item->key, key)) {
+    return false;
+  }
+  if (map->verify_keys && kstr != NULL) {
+    return item->key_len == klen && memcmp(item->key_str, kstr, klen) == 0;
+  }
+  return true;
+}
+
+/* monotonic milliseconds, the clock TTLs are tracked on */
+static uint64_t _now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* true when the map expires items and this one is past its deadline */
+static bool _expired(HashMap *map, const HashMapBucketItem *item) {
+  return map->expiring && item->expiry != 0 && item->expiry <= _now_ms();
+}
+
+/* free an expired item and turn its slot into a tombstone (live arrays) or
+ * a plain hole (old migration arrays, which are scanned in full) */
+static void _reclaim_expired(HashMap *map, HashMapBucket *node,
+                             HashMapBucketItem *item, uint8_t *ctrl,
+                             bool old) {
+  if (map->free_item) {
+    map->free_item(item->data);
+  }
+  if (map->verify_keys && !_in_snapshot(map, item->key_str)) {
+    free(item->key_str);
+  }
+  _write_begin(map, node);
+  *ctrl = old ? CTRL_EMPTY : CTRL_TOMB;
+  memset(item, 0, sizeof(*item));
+  _write_end(map, node);
+  if (!old) {
+    node->tombs++;
+  }
+  node->count--;
+  __atomic_fetch_sub(&map->_count, 1, __ATOMIC_RELAXED);
+}
+
+/* reinsert every occupied slot of src into the (items, ctrl) arrays, which
+ * must be zeroed and large enough to hold the source items */
+static void _reinsert_items(HashMapBucketItem *items, uint8_t *ctrl,
+                            size_t capacity, const HashMapBucketItem *src,
+                            const uint8_t *src_ctrl, size_t src_capacity) {
+  size_t mask = capacity - 1;
+  size_t i = 0;
+  for (i = 0; i < src_capacity; i++) {
+    if (!_ctrl_live(src_ctrl[i])) {
+      continue;
+    }
+    size_t idx = src[i].key.skey & mask;
+    size_t j = 0;
+    for (j = 0; j < capacity; j++) {
+      size_t slot = (idx + j) & mask;
+      if (ctrl[slot] == CTRL_EMPTY) {
+        memcpy(&items[slot], &src[i], sizeof(*items));
+        ctrl[slot] = _h2(src[i].key);
+        break;
+      }
+    }
+  }
+}
+
+/* migrated-out slots leave holes in the old arrays, so probe chains are
+ * broken there: scan every slot instead of stopping at the first empty */
+static HashMapBucketItem *_find_in_old(HashMap *map, HashMapBucket *node,
+                                       HashMapBucketKey key, const char *kstr,
+                                       size_t klen) {
+  uint8_t h2 = _h2(key);
+  size_t i = 0;
+  for (i = 0; i < node->old_capacity; i++) {
+    if (node->old_ctrl[i] == h2 &&
+        _item_matches(map, &node->old_items[i], key, kstr, klen)) {
+      if (_expired(map, &node->old_items[i])) {
+        _reclaim_expired(map, node, &node->old_items[i], &node->old_ctrl[i],
+                         true);
+        return NULL;
+      }
+      return &node->old_items[i];
+    }
+  }
+  return NULL;
+}
+
+/* move up to budget slots of a pending migration into the live arrays,
+ * release the old arrays once the sweep is done */
+static void _migrate_step(HashMap *map, HashMapBucket *node, size_t budget) {
+  if (!map->incremental || node->old_items == NULL) {
+    return;
+  }
+  size_t scanned = 0;
+  while (node->migrate_pos < node->old_capacity && scanned < budget) {
+    HashMapBucketItem *item = &node->old_items[node->migrate_pos];
+    if (_ctrl_live(node->old_ctrl[node->migrate_pos])) {
+      _reinsert_items(node->items, node->ctrl, node->capacity, item,
+                      &node->old_ctrl[node->migrate_pos], 1);
+    }
+    node->migrate_pos++;
+    scanned++;
+  }
+  if (node->migrate_pos >= node->old_capacity) {
+    _items_free(map, node->old_items, node->old_capacity);
+    _ctrl_free(map, node->old_ctrl, node->old_capacity);
+    node->old_items = NULL;
+    node->old_ctrl = NULL;
+    node->old_capacity = 0;
+    node->migrate_pos = 0;
+  }
+}
+
+static void _migrate_drain(HashMap *map, HashMapBucket *node) {
+  _migrate_step(map, node, (size_t)-1);
+}
+
+/* the bucket owning a key: during a table extension (see hashmap_extend)
+ * buckets below the migration cursor have moved to the larger table */
+static HashMapBucket *_locate(HashMap *map, HashMapBucketKey key) {
+  if (map->ext_table != NULL && (key.pkey & map->mask) < map->ext_pos) {
+    return &map->ext_table[key.pkey & map->ext_mask];
+  }
+  return &map->table[key.pkey & map->mask];
+}
+
 static HashMapBucketItem *_get_item(HashMap *map, HashMapBucketKey key,
-                                    bool empty, HashMapBucket **n) {
-  HashMapBucket *node = &map->table[key.pkey % map->capacity];
+                                    const char *kstr, size_t klen, bool empty,
+                                    HashMapBucket **n) {
+  HashMapBucket *node = _locate(map, key);
   if (n) {
     *n = node;
   }
   if (node->capacity == 0) {
     return NULL;
   }
-  size_t idx = key.skey % node->capacity;
+  size_t idx = key.skey & node->mask;
+  uint8_t h2 = _h2(key);
+  /* first tombstone seen before the end of the probe chain: if the key is
+   * absent, an insert lands there instead of lengthening the chain */
+  HashMapBucketItem *first_tomb = NULL;
+#if defined(__SSE2__)
+  if ((node->capacity & 15) == 0) {
+    /* Swiss-table style kernel: one compare covers 16 control bytes,
+     * candidate slots are then visited in probe order */
+    __m128i vmatch = _mm_set1_epi8((char)h2);
+    __m128i vempty = _mm_setzero_si128();
+    __m128i vtomb = _mm_set1_epi8((char)CTRL_TOMB);
+    size_t first = idx & ~(size_t)15;
+    uint32_t head = (uint32_t)(idx - first);
+    size_t groups = node->capacity / 16;
+    size_t g = 0;
+    for (g = 0; g <= groups; g++) {
+      size_t base = (first + g * 16) & node->mask;
+      __m128i ctrl = _mm_loadu_si128((const __m128i *)&node->ctrl[base]);
+      uint32_t match =
+          (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, vmatch));
+      uint32_t free_slots =
+          (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, vempty));
+      uint32_t tombs =
+          empty ? (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, vtomb))
+                : 0;
+      if (g == 0) {
+        /* lanes before the probe start are visited after the wrap-around,
+         * by rescanning this group as the last one */
+        match &= ~((1u << head) - 1);
+        free_slots &= ~((1u << head) - 1);
+        tombs &= ~((1u << head) - 1);
+      } else if (g == groups) {
+        match &= (1u << head) - 1;
+        free_slots &= (1u << head) - 1;
+        tombs &= (1u << head) - 1;
+      }
+      if (first_tomb == NULL && tombs != 0) {
+        /* only tombstones before the chain-ending empty lane count */
+        if (free_slots != 0) {
+          tombs &= (free_slots & (~free_slots + 1)) - 1;
+        }
+        if (tombs != 0) {
+          first_tomb = &node->items[base + (size_t)__builtin_ctz(tombs)];
+        }
+      }
+      uint32_t candidates = match | free_slots;
+      while (candidates) {
+        uint32_t bit = candidates & (~candidates + 1);
+        size_t slot = base + (size_t)__builtin_ctz(candidates);
+        /* the first empty slot ends the probe chain */
+        if (free_slots & bit) {
+          if (!empty) {
+            return NULL;
+          }
+          return first_tomb != NULL ? first_tomb : &node->items[slot];
+        }
+        if (_item_matches(map, &node->items[slot], key, kstr, klen)) {
+          if (!_expired(map, &node->items[slot])) {
+            return &node->items[slot];
+          }
+          /* past its TTL: reclaim in passing, the key is absent now */
+          _reclaim_expired(map, node, &node->items[slot], &node->ctrl[slot],
+                           false);
+          if (!empty) {
+            return NULL;
+          }
+          return first_tomb != NULL ? first_tomb : &node->items[slot];
+        }
+        candidates &= candidates - 1;
+      }
+    }
+    return empty ? first_tomb : NULL;
+  }
+#endif
   size_t i = 0;
   for (i = 0; i < node->capacity; i++) {
-    /* find the node */
-    if (node->items[(idx + i) % node->capacity].data != NULL &&
-        KEY_EQU(node->items[(idx + i) % node->capacity].key, key)) {
-      return &node->items[(idx + i) % node->capacity];
+    size_t slot = (idx + i) & node->mask;
+    /* the first empty slot ends the probe chain; in set the first
+     * tombstone of the chain, or this empty slot, is the insertion point */
+    if (node->ctrl[slot] == CTRL_EMPTY) {
+      if (!empty) {
+        return NULL;
+      }
+      return first_tomb != NULL ? first_tomb : &node->items[slot];
+    }
+    if (empty && first_tomb == NULL && node->ctrl[slot] == CTRL_TOMB) {
+      first_tomb = &node->items[slot];
+    }
+    if (node->ctrl[slot] == h2 &&
+        _item_matches(map, &node->items[slot], key, kstr, klen)) {
+      if (!_expired(map, &node->items[slot])) {
+        return &node->items[slot];
+      }
+      /* past its TTL: reclaim in passing, the key is absent now */
+      _reclaim_expired(map, node, &node->items[slot], &node->ctrl[slot],
+                       false);
+      if (!empty) {
+        return NULL;
+      }
+      return first_tomb != NULL ? first_tomb : &node->items[slot];
+    }
+  }
+  return empty ? first_tomb : NULL;
+}
+
+static size_t _min_bucket_capacity(HashMap *map) {
+#if HASH_MAP_BUCKET_INLINE > 0
+  (void)map;
+  return HASH_MAP_BUCKET_INLINE;
+#else
+  return map->config.bucket_size;
+#endif
+}
+
+/* rebuild the bucket's arrays at new_capacity, which must hold its live
+ * items. Shared callers: the delete-path hysteresis shrink and
+ * hashmap_shrink_to_fit. */
+static bool _shrink_node_to(HashMap *map, HashMapBucket *node,
+                            size_t new_capacity) {
+  HashMapBucketItem *items = NULL;
+  uint8_t *ctrl = NULL;
+#if HASH_MAP_BUCKET_INLINE > 0
+  if (new_capacity <= HASH_MAP_BUCKET_INLINE) {
+    /* small enough to move back into the bucket itself */
+    new_capacity = HASH_MAP_BUCKET_INLINE;
+    items = node->inline_items;
+    memset(items, 0, sizeof(node->inline_items));
+    ctrl = node->inline_ctrl;
+    memset(ctrl, CTRL_EMPTY, sizeof(node->inline_ctrl));
+  }
+#endif
+  if (items == NULL) {
+    items = _items_alloc(map, new_capacity);
+    if (items == NULL) {
+      return false;
+    }
+    ctrl = _ctrl_alloc(map, new_capacity);
+    if (ctrl == NULL) {
+      _items_free(map, items, new_capacity);
+      return false;
+    }
+  }
+
+  _reinsert_items(items, ctrl, new_capacity, node->items, node->ctrl,
+                  node->capacity);
+
+  void *tmp = node->items;
+  void *tmp_ctrl = node->ctrl;
+  size_t old_capacity = node->capacity;
+  _write_begin(map, node);
+  node->items = items;
+  node->ctrl = ctrl;
+  node->capacity = new_capacity;
+  node->mask = new_capacity - 1;
+  _write_end(map, node);
+  if (map->read_mostly) {
+    _retire(map, tmp);
+    _retire(map, tmp_ctrl);
+  } else if (!_in_snapshot(map, tmp)) {
+    _items_free(map, tmp, old_capacity);
+    _ctrl_free(map, tmp_ctrl, old_capacity);
+  }
+  node->tombs = 0;
+  node->generation++;
+  return true;
+}
+
+static bool _shrink_node_if_needed(HashMap *map, HashMapBucketKey key) {
+  assert(map != NULL);
+  HashMapBucket *node = _locate(map, key);
+  size_t min_capacity = _min_bucket_capacity(map);
+  /* deletes only leave a tombstone behind, so nothing is rebuilt here
+   * unless the live count warrants an actual capacity reduction, and never
+   * while a migration is pending */
+  if (node->old_items != NULL || node->capacity <= min_capacity ||
+      node->count > node->capacity * map->config.shrink_factor) {
+    return true;
+  }
+
+  /* We reduce the size of the bucket by creating a new items array */
+  size_t new_capacity = node->capacity / map->config.growth;
+  if (new_capacity < min_capacity) {
+    new_capacity = min_capacity;
+  }
+  return _shrink_node_to(map, node, new_capacity);
+}
+
+/* give the bucket private array copies before a write while its arrays are
+ * shared with a clone, see hashmap_clone. Exclusively owned buckets return
+ * immediately, so the check costs one branch on the write path. */
+static bool _unshare_node(HashMap *map, HashMapBucket *node) {
+  if (node->shares == NULL) {
+    return true;
+  }
+  HashMapBucketItem *items = _items_alloc(map, node->capacity);
+  if (items == NULL) {
+    return false;
+  }
+  uint8_t *ctrl = _ctrl_alloc(map, node->capacity);
+  if (ctrl == NULL) {
+    _items_free(map, items, node->capacity);
+    return false;
+  }
+  memcpy(items, node->items, node->capacity * sizeof(*items));
+  memcpy(ctrl, node->ctrl, _ctrl_size(node->capacity));
+  if (__atomic_sub_fetch(node->shares, 1, __ATOMIC_ACQ_REL) == 0) {
+    /* every other holder un-shared or was destroyed in the meantime */
+    free(node->shares);
+    free(node->items);
+    free(node->ctrl);
+  }
+  node->shares = NULL;
+  node->items = items;
+  node->ctrl = ctrl;
+  return true;
+}
+
+static bool _grow_node_if_needed(HashMap *map, HashMapBucketKey key) {
+  HashMapBucket *node = _locate(map, key);
+  if (!_unshare_node(map, node)) {
+    return false;
+  }
+  /* tombstones occupy slots like live items do: probes cannot stop early
+   * on them, so they count against the load factor */
+  if (node->count + node->tombs + 1 <
+      node->capacity * map->config.load_factor) {
+    return true;
+  }
+
+  size_t new_capacity =
+      (node->capacity == 0 ? map->config.bucket_size
+                           : (node->capacity * map->config.growth));
+  if (node->capacity > 0 &&
+      node->count + 1 < node->capacity * map->config.load_factor) {
+    /* mostly tombstones: rebuild at the same capacity instead of growing,
+     * the reinsertion drops them */
+    new_capacity = node->capacity;
+  }
+#if HASH_MAP_BUCKET_INLINE > 0
+  if (node->capacity == 0) {
+    /* first items land inline in the bucket, no allocation at all */
+    _write_begin(map, node);
+    node->items = node->inline_items;
+    node->ctrl = node->inline_ctrl;
+    node->capacity = HASH_MAP_BUCKET_INLINE;
+    node->mask = HASH_MAP_BUCKET_INLINE - 1;
+    _write_end(map, node);
+    if (node->count + 1 < node->capacity * map->config.load_factor) {
+      return true;
     }
-    /* accept empty node because we are in set, first empty is given */
-    if (empty && node->items[(idx + i) % node->capacity].data == NULL) {
-      return &node->items[(idx + i) % node->capacity];
+    new_capacity = node->capacity * map->config.growth;
+  }
+  if (new_capacity < map->config.bucket_size) {
+    new_capacity = map->config.bucket_size;
+  }
+#endif
+  size_t new_size = new_capacity * sizeof(*node->items);
+  if (node->capacity > 0 && map->incremental && !_bucket_inline(node)) {
+    /* do not rehash anything now: park the current arrays aside and let the
+     * following operations on this bucket drain them a few slots at a time */
+    HashMapBucketItem *items = _items_alloc(map, new_capacity);
+    if (!items) {
+      return false;
+    }
+    uint8_t *ctrl = _ctrl_alloc(map, new_capacity);
+    if (!ctrl) {
+      _items_free(map, items, new_capacity);
+      return false;
+    }
+    /* only one migration at a time, finish a pending one first */
+    _migrate_drain(map, node);
+    node->old_items = node->items;
+    node->old_ctrl = node->ctrl;
+    node->old_capacity = node->capacity;
+    node->migrate_pos = 0;
+    node->items = items;
+    node->ctrl = ctrl;
+    node->capacity = new_capacity;
+    node->mask = new_capacity - 1;
+  } else if (node->capacity > 0 && map->read_mostly) {
+    /* readers may be probing node->items right now: never realloc it in
+     * place, build the bigger array aside, publish it, retire the old one */
+    HashMapBucketItem *items = calloc(new_capacity, sizeof(*items));
+    if (!items) {
+      return false;
+    }
+    uint8_t *ctrl = _ctrl_alloc(map, new_capacity);
+    if (!ctrl) {
+      free(items);
+      return false;
+    }
+    _reinsert_items(items, ctrl, new_capacity, node->items, node->ctrl,
+                    node->capacity);
+    void *old = node->items;
+    void *old_ctrl = node->ctrl;
+    bool was_inline = _bucket_inline(node);
+    _write_begin(map, node);
+    node->items = items;
+    node->ctrl = ctrl;
+    node->capacity = new_capacity;
+    node->mask = new_capacity - 1;
+    _write_end(map, node);
+    if (!was_inline) {
+      _retire(map, old);
+      _retire(map, old_ctrl);
+    }
+  } else if (node->capacity > 0 && map->use_arena) {
+    /* the current arrays stay readable while the bigger ones are filled, so
+     * no scratch copy is needed, and the old blocks go back to the pool */
+    HashMapBucketItem *items = _items_alloc(map, new_capacity);
+    if (!items) {
+      return false;
+    }
+    uint8_t *ctrl = _ctrl_alloc(map, new_capacity);
+    if (!ctrl) {
+      _items_free(map, items, new_capacity);
+      return false;
+    }
+    _reinsert_items(items, ctrl, new_capacity, node->items, node->ctrl,
+                    node->capacity);
+    if (!_bucket_inline(node)) {
+      _items_free(map, node->items, node->capacity);
+      _ctrl_free(map, node->ctrl, node->capacity);
+    }
+    node->items = items;
+    node->ctrl = ctrl;
+    node->capacity = new_capacity;
+    node->mask = new_capacity - 1;
+  } else if (node->capacity > 0) {
+    HashMapBucketItem *scratch = _get_scratch(map, node->capacity);
+    if (!scratch) {
+      return false;
+    }
+
+    memcpy(scratch, node->items, sizeof(*node->items) * node->capacity);
+    /* the grown arrays are zeroed in place before the reinsertion sweep,
+     * keep a copy of the control bytes alongside the item scratch */
+    uint8_t *scratch_ctrl = malloc(node->capacity);
+    if (!scratch_ctrl) {
+      _release_scratch(map, scratch);
+      return false;
+    }
+    memcpy(scratch_ctrl, node->ctrl, node->capacity);
+    /* inline and snapshot-mapped arrays cannot be realloc'd, spill to a
+     * fresh heap one */
+    bool unowned = _bucket_inline(node) || _in_snapshot(map, node->items);
+    HashMapBucketItem *old_items = node->items;
+    void *tmp = unowned ? malloc(new_size) : realloc(node->items, new_size);
+    if (!tmp) {
+      free(scratch_ctrl);
+      _release_scratch(map, scratch);
+      return false;
+    }
+    node->items = tmp;
+    uint8_t *ctrl = unowned ? _ctrl_alloc(map, new_capacity)
+                            : realloc(node->ctrl, _ctrl_size(new_capacity));
+    if (!ctrl) {
+      if (unowned) {
+        /* keep the old array, do not leave the bucket half spilled */
+        free(tmp);
+        node->items = old_items;
+      }
+      free(scratch_ctrl);
+      _release_scratch(map, scratch);
+      return false;
     }
+    node->ctrl = ctrl;
+
+    size_t old_capacity = node->capacity;
+    node->capacity = new_capacity;
+    node->mask = new_capacity - 1;
+    memset(node->items, 0, sizeof(*node->items) * node->capacity);
+    memset(node->ctrl, CTRL_EMPTY, node->capacity);
+    _reinsert_items(node->items, node->ctrl, node->capacity, scratch,
+                    scratch_ctrl, old_capacity);
+    free(scratch_ctrl);
+    _release_scratch(map, scratch);
+  } else {
+    HashMapBucketItem *items = _items_alloc(map, new_capacity);
+    if (!items) {
+      return false;
+    }
+    uint8_t *ctrl = _ctrl_alloc(map, new_capacity);
+    if (!ctrl) {
+      _items_free(map, items, new_capacity);
+      return false;
+    }
+    _write_begin(map, node);
+    node->items = items;
+    node->ctrl = ctrl;
+    node->capacity = new_capacity;
+    node->mask = new_capacity - 1;
+    _write_end(map, node);
+  }
+
+  /* the reinsertion dropped any tombstones, and slot indexes cached in
+   * HashMapEntry handles are stale now */
+  node->tombs = 0;
+  node->generation++;
+  return true;
+}
+
+static bool _reserve_node(HashMap *map, HashMapBucket *node,
+                          size_t total) {
+  if (!_unshare_node(map, node)) {
+    return false;
+  }
+  _migrate_drain(map, node);
+  size_t capacity = node->capacity > map->config.bucket_size
+                        ? node->capacity
+                        : map->config.bucket_size;
+  while (total >= capacity * map->config.load_factor) {
+    capacity *= map->config.growth;
+  }
+  if (capacity <= node->capacity) {
+    return true;
+  }
+  HashMapBucketItem *items = _items_alloc(map, capacity);
+  if (!items) {
+    return false;
+  }
+  uint8_t *ctrl = _ctrl_alloc(map, capacity);
+  if (!ctrl) {
+    _items_free(map, items, capacity);
+    return false;
+  }
+  if (node->capacity > 0) {
+    _reinsert_items(items, ctrl, capacity, node->items, node->ctrl,
+                    node->capacity);
+  }
+  void *tmp = node->items;
+  void *tmp_ctrl = node->ctrl;
+  bool owned = node->capacity > 0 && !_bucket_inline(node) &&
+               !_in_snapshot(map, node->items);
+  size_t old_capacity = node->capacity;
+  _write_begin(map, node);
+  node->items = items;
+  node->ctrl = ctrl;
+  node->capacity = capacity;
+  node->mask = capacity - 1;
+  _write_end(map, node);
+  if (owned) {
+    if (map->read_mostly) {
+      _retire(map, tmp);
+      _retire(map, tmp_ctrl);
+    } else {
+      _items_free(map, tmp, old_capacity);
+      _ctrl_free(map, tmp_ctrl, old_capacity);
+    }
+  }
+  node->tombs = 0;
+  node->generation++;
+  return true;
+}
+
+/* Gradual primary-table extension, see hashmap_extend. The old table
+ * drains in bucket order, a few buckets per operation. Both capacities are
+ * powers of two, so old bucket i spreads exactly over ext buckets
+ * i + k * capacity: every target can be reserved up front and the move
+ * itself cannot fail mid-bucket. */
+
+static void _extend_finish(HashMap *map) {
+  if (map->_table_heap) {
+    free(map->table);
+  }
+  map->table = map->ext_table;
+  map->capacity = map->ext_capacity;
+  map->mask = map->ext_mask;
+  map->_table_heap = true;
+  map->ext_table = NULL;
+  map->ext_capacity = 0;
+  map->ext_mask = 0;
+  map->ext_pos = 0;
+}
+
+/* place one migrated item, room was reserved beforehand */
+static void _ext_place(HashMap *map, HashMapBucketItem *item) {
+  HashMapBucket *enode = &map->ext_table[item->key.pkey & map->ext_mask];
+  size_t j = item->key.skey & enode->mask;
+  while (_ctrl_live(enode->ctrl[j])) {
+    j = (j + 1) & enode->mask;
+  }
+  /* a migrating key cannot already sit in this bucket, so stopping on a
+   * tombstone is safe */
+  if (enode->ctrl[j] == CTRL_TOMB) {
+    enode->tombs--;
+  }
+  enode->items[j] = *item;
+  enode->ctrl[j] = _h2(item->key);
+  enode->count++;
+}
+
+static void _extend_step(HashMap *map, size_t buckets) {
+  while (map->ext_table != NULL && buckets-- > 0) {
+    if (map->ext_pos >= map->capacity) {
+      _extend_finish(map);
+      return;
+    }
+    HashMapBucket *node = &map->table[map->ext_pos];
+    if (!_unshare_node(map, node)) {
+      return; /* out of memory, the next operation retries */
+    }
+    _migrate_drain(map, node);
+    if (node->count > 0) {
+      size_t spread = map->ext_capacity / map->capacity;
+      size_t k = 0;
+      size_t j = 0;
+      for (k = 0; k < spread; k++) {
+        size_t target = map->ext_pos + k * map->capacity;
+        HashMapBucket *enode = &map->ext_table[target];
+        size_t add = 0;
+        for (j = 0; j < node->capacity; j++) {
+          if (_ctrl_live(node->ctrl[j]) &&
+              (node->items[j].key.pkey & map->ext_mask) == target) {
+            add++;
+          }
+        }
+        /* tombstones count too: the placement loop must always find a
+         * free or reusable slot */
+        if (add > 0 &&
+            !_reserve_node(map, enode, enode->count + enode->tombs + add)) {
+          return; /* out of memory, the next operation retries */
+        }
+      }
+      for (j = 0; j < node->capacity; j++) {
+        if (_ctrl_live(node->ctrl[j])) {
+          _ext_place(map, &node->items[j]);
+        }
+      }
+    }
+    if (node->capacity > 0 && !_bucket_inline(node) &&
+        !_in_snapshot(map, node->items)) {
+      _items_free(map, node->items, node->capacity);
+      _ctrl_free(map, node->ctrl, node->capacity);
+    }
+    memset(node, 0, sizeof(*node));
+    map->ext_pos++;
+  }
+}
+
+static HashMapBucketKey _compute_key(HashMap *map, const char *key) {
+  size_t key_len = strlen(key);
+  assert(key_len > 0);
+  return hashmap_hash(map, key, key_len);
+}
+
+/* Hugepage and NUMA placement for the map block (header + primary table),
+ * see HashMapConfig. All of it is best effort: on kernels without hugepage
+ * or NUMA support the map works exactly as before, just on regular
+ * first-touch pages. */
+
+#if defined(__linux__) && defined(__NR_mbind)
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+/* one bit per online NUMA node, probed through sysfs so there is no libnuma
+ * dependency */
+static unsigned long _numa_node_mask(void) {
+  unsigned long mask = 0;
+  int node = 0;
+  for (node = 0; node < (int)(sizeof(mask) * 8); node++) {
+    char path[48];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+    if (access(path, F_OK) == 0) {
+      mask |= 1UL << node;
+    }
+  }
+  return mask;
+}
+#endif
+
+static void _numa_place(void *base, size_t size, const HashMapConfig *config) {
+#if defined(__linux__) && defined(__NR_mbind)
+  unsigned long mask = 0;
+  int mode = 0;
+  if (config->numa_interleave) {
+    mask = _numa_node_mask();
+    mode = MPOL_INTERLEAVE;
+  } else if (config->numa_node > 0) {
+    mask = 1UL << (config->numa_node - 1);
+    mode = MPOL_BIND;
+  }
+  if (mask == 0) {
+    return;
+  }
+  /* has to run before the pages are first touched, placement is decided on
+   * the fault. A failure (bad node, kernel without NUMA) is ignored. */
+  syscall(__NR_mbind, base, size, mode, &mask, sizeof(mask) * 8, 0);
+#else
+  (void)base;
+  (void)size;
+  (void)config;
+#endif
+}
+
+static HashMap *_map_alloc(size_t size, const HashMapConfig *config) {
+  if (config == NULL || (!config->huge_pages && config->numa_node <= 0 &&
+                         !config->numa_interleave)) {
+    return calloc(1, size);
+  }
+  size_t map_size =
+      (size + HASH_MAP_HUGE_PAGE_SIZE - 1) & ~(HASH_MAP_HUGE_PAGE_SIZE - 1);
+  void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (config->huge_pages) {
+    /* explicit hugepages first, needs pages reserved via vm.nr_hugepages */
+    base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (base == MAP_FAILED) {
+    base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      /* no room for the rounded mapping, a plain allocation may still fit */
+      return calloc(1, size);
+    }
+#ifdef MADV_HUGEPAGE
+    if (config->huge_pages) {
+      madvise(base, map_size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  _numa_place(base, map_size, config);
+  /* fresh mmap'd memory is already zeroed */
+  HashMap *map = base;
+  map->_map_size = map_size;
+  return map;
+}
+
+/* a fresh per-map seed, see HashMapConfig.random_seed. Falls back to clock
+ * and stack-address entropy should /dev/urandom be unreadable. */
+static uint64_t _random_seed(void) {
+  uint64_t seed = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+      seed = 0;
+    }
+    close(fd);
+  }
+  if (seed == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed = _hash_mix((uint64_t)ts.tv_nsec ^ (uint64_t)ts.tv_sec,
+                     (uint64_t)(uintptr_t)&ts);
+  }
+  return seed;
+}
+
+static HashMap *_create(size_t capacity, const HashMapConfig *config,
+                        HashMapHashFunction hash_function,
+                        HashMapFreeItemFunction free_item) {
+  assert(capacity > 0);
+  capacity = _round_up_pow2(capacity);
+  HashMap *map =
+      _map_alloc(sizeof(*map) + (sizeof(*map->table) * capacity), config);
+  if (map) {
+    map->table = (HashMapBucket *)(((void *)map) + sizeof(*map));
+    map->capacity = capacity;
+    map->mask = capacity - 1;
+    map->free_item = free_item;
+    map->hash_function = hash_function;
+    map->config.bucket_size = HASH_MAP_BUCKET_SIZE;
+    map->config.growth = 2;
+    map->config.load_factor = HASH_MAP_LOAD_FACTOR;
+    map->config.shrink_factor = 1 - HASH_MAP_LOAD_FACTOR;
+    map->config.overload_factor = HASH_MAP_OVERLOAD_FACTOR;
+  }
+  return map;
+}
+
+/* Public API */
+HashMap *hashmap_create(size_t capacity, HashMapHashFunction hash_function,
+                        HashMapFreeItemFunction free_item) {
+  return _create(capacity, NULL, hash_function, free_item);
+}
+
+HashMap *hashmap_create_ex(size_t capacity, const HashMapConfig *config,
+                           HashMapHashFunction hash_function,
+                           HashMapFreeItemFunction free_item) {
+  HashMap *map = _create(capacity, config, hash_function, free_item);
+  if (!map || !config) {
+    return map;
+  }
+  /* zero or out-of-range fields keep the compile-time defaults; sizes are
+   * rounded so bucket capacities stay powers of two */
+  if (config->bucket_size > 0) {
+    map->config.bucket_size = _round_up_pow2(config->bucket_size);
+  }
+  if (config->growth > 1) {
+    map->config.growth = _round_up_pow2(config->growth);
+  }
+  if (config->load_factor > 0 && config->load_factor <= 1) {
+    map->config.load_factor = config->load_factor;
+  }
+  if (config->shrink_factor > 0 &&
+      config->shrink_factor < map->config.load_factor) {
+    map->config.shrink_factor = config->shrink_factor;
+  }
+  /* placement was consumed at allocation time, kept on the map so arena
+   * chunks allocated later inherit the hugepage advice */
+  map->config.huge_pages = config->huge_pages;
+  map->config.numa_node = config->numa_node;
+  map->config.numa_interleave = config->numa_interleave;
+  if (config->random_seed) {
+    map->seed = _random_seed();
+  } else {
+    map->seed = config->seed;
+  }
+  map->seeded_hash_function = config->seeded_hash;
+  if (config->overload_factor > 1) {
+    map->config.overload_factor = config->overload_factor;
+  }
+  return map;
+}
+
+HashMap *hashmap_create_concurrent(size_t capacity, size_t stripes,
+                                   HashMapHashFunction hash_function,
+                                   HashMapFreeItemFunction free_item) {
+  HashMap *map = hashmap_create(capacity, hash_function, free_item);
+  if (!map) {
+    return NULL;
+  }
+  if (stripes == 0) {
+    stripes = HASH_MAP_DEFAULT_STRIPES;
+  }
+  if (stripes > capacity) {
+    stripes = capacity;
+  }
+  map->locks = calloc(stripes, sizeof(*map->locks));
+  if (!map->locks) {
+    hashmap_destroy(map);
+    return NULL;
+  }
+  size_t i = 0;
+  for (i = 0; i < stripes; i++) {
+    if (pthread_mutex_init(&map->locks[i], NULL) != 0) {
+      while (i > 0) {
+        pthread_mutex_destroy(&map->locks[--i]);
+      }
+      free(map->locks);
+      map->locks = NULL;
+      hashmap_destroy(map);
+      return NULL;
+    }
+  }
+  map->lock_count = stripes;
+  return map;
+}
+
+HashMap *hashmap_create_verified(size_t capacity,
+                                 HashMapHashFunction hash_function,
+                                 HashMapFreeItemFunction free_item) {
+  HashMap *map = hashmap_create(capacity, hash_function, free_item);
+  if (map) {
+    map->verify_keys = true;
+  }
+  return map;
+}
+
+HashMap *hashmap_create_arena(size_t capacity, size_t stripes,
+                              HashMapHashFunction hash_function,
+                              HashMapFreeItemFunction free_item) {
+  HashMap *map =
+      stripes > 0
+          ? hashmap_create_concurrent(capacity, stripes, hash_function,
+                                      free_item)
+          : hashmap_create(capacity, hash_function, free_item);
+  if (!map) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&map->_arena_lock, NULL) != 0) {
+    hashmap_destroy(map);
+    return NULL;
+  }
+  map->use_arena = true;
+  return map;
+}
+
+HashMap *hashmap_create_inline(size_t capacity,
+                               HashMapHashFunction hash_function,
+                               size_t value_size) {
+  assert(value_size > 0);
+  assert(value_size <= sizeof(void *));
+  /* values live in the data slot itself, there is nothing to free */
+  HashMap *map = hashmap_create(capacity, hash_function, NULL);
+  if (map) {
+    map->value_size = value_size;
+  }
+  return map;
+}
+
+HashMap *hashmap_create_expiring(size_t capacity,
+                                 HashMapHashFunction hash_function,
+                                 HashMapFreeItemFunction free_item) {
+  HashMap *map = hashmap_create(capacity, hash_function, free_item);
+  if (map) {
+    map->expiring = true;
+  }
+  return map;
+}
+
+HashMap *hashmap_create_incremental(size_t capacity,
+                                    HashMapHashFunction hash_function,
+                                    HashMapFreeItemFunction free_item) {
+  HashMap *map = hashmap_create(capacity, hash_function, free_item);
+  if (map) {
+    map->incremental = true;
+  }
+  return map;
+}
+
+HashMap *hashmap_create_read_mostly(size_t capacity, size_t stripes,
+                                    HashMapHashFunction hash_function,
+                                    HashMapFreeItemFunction free_item) {
+  HashMap *map =
+      hashmap_create_concurrent(capacity, stripes, hash_function, free_item);
+  if (!map) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&map->_retired_lock, NULL) != 0) {
+    hashmap_destroy(map);
+    return NULL;
+  }
+  map->read_mostly = true;
+  return map;
+}
+
+void hashmap_quiesce(HashMap *map) {
+  assert(map != NULL);
+  if (!map->read_mostly) {
+    return;
+  }
+  pthread_mutex_lock(&map->_retired_lock);
+  void *head = map->_retired_head;
+  map->_retired_head = NULL;
+  pthread_mutex_unlock(&map->_retired_lock);
+  while (head) {
+    void *next = *(void **)head;
+    free(head);
+    head = next;
+  }
+}
+
+HashMapBucketKey hashmap_hash(HashMap *map, const char *key, size_t len) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(len > 0);
+  /* the built-in call is direct and inlinable, only a user-provided hash
+   * goes through the function pointer */
+  uint64_t ukey = 0;
+  if (map->seeded_hash_function != NULL) {
+    ukey = map->seeded_hash_function(key, len, map->seed);
+  } else if (map->hash_function != NULL) {
+    ukey = map->hash_function(key, len);
+  } else {
+    ukey = _builtin_hash(key, len, map->seed);
+  }
+  HashMapBucketKey k = {.pkey = (uint32_t)(ukey & 0xFFFFFFFF),
+                        .skey = (uint32_t)(ukey >> 32)};
+  return k;
+}
+
+/* the write half of _set: bucket lock held, growth already settled */
+static bool _set_locked(HashMap *map, HashMapBucketKey ukey,
+                        const char *kstr, size_t klen, void *data,
+                        uint64_t expiry) {
+  HashMapBucket *node = NULL;
+  _migrate_step(map, _locate(map, ukey), HASH_MAP_MIGRATE_STEP);
+  if (map->incremental) {
+    HashMapBucket *mnode = _locate(map, ukey);
+    if (mnode->old_items != NULL) {
+      /* if the key still sits in the old arrays, move it into the live
+       * ones so the write below hits a single copy of it */
+      HashMapBucketItem *old = _find_in_old(map, mnode, ukey, kstr, klen);
+      if (old != NULL) {
+        _reinsert_items(mnode->items, mnode->ctrl, mnode->capacity, old,
+                        &mnode->old_ctrl[old - mnode->old_items], 1);
+        mnode->old_ctrl[old - mnode->old_items] = CTRL_EMPTY;
+        memset(old, 0, sizeof(*old));
+      }
+    }
+  }
+  HashMapBucketItem *item = _get_item(map, ukey, kstr, klen, true, &node);
+  if (!item) {
+    return false;
+  }
+  char *key_copy = NULL;
+  if (!_ctrl_live(node->ctrl[item - node->items])) {
+    if (map->verify_keys) {
+      key_copy = malloc(klen + 1);
+      if (!key_copy) {
+        return false;
+      }
+      memcpy(key_copy, kstr, klen);
+      key_copy[klen] = '\0';
+    }
+    if (node->ctrl[item - node->items] == CTRL_TOMB) {
+      node->tombs--;
+    }
+    node->count++;
+    __atomic_fetch_add(&map->_count, 1, __ATOMIC_RELAXED);
+  } else {
+    if (map->free_item) {
+      map->free_item(item->data);
+      item->data = NULL;
+    }
+  }
+  _write_begin(map, node);
+  item->key = ukey;
+  if (key_copy) {
+    item->key_str = key_copy;
+    item->key_len = klen;
+  }
+  item->data = data;
+  item->expiry = expiry;
+  node->ctrl[item - node->items] = _h2(ukey);
+  _write_end(map, node);
+  return true;
+}
+
+static bool _set(HashMap *map, HashMapBucketKey ukey, const char *kstr,
+                 size_t klen, void *data, uint64_t expiry) {
+  _extend_step(map, HASH_MAP_EXTEND_STEP);
+  _lock_key(map, ukey);
+  bool ok = _grow_node_if_needed(map, ukey) &&
+            _set_locked(map, ukey, kstr, klen, data, expiry);
+  _unlock_key(map, ukey);
+  return ok;
+}
+
+/* grow the bucket straight to a capacity holding total items in a single
+ * allocation and rehash, skipping the doubling ladder */
+bool hashmap_set_bulk(HashMap *map, const char **keys, void **values,
+                      size_t n) {
+  assert(map != NULL);
+  assert(keys != NULL);
+  assert(values != NULL);
+  if (n == 0) {
+    return true;
+  }
+  HashMapBucketKey *ukeys = malloc(n * sizeof(*ukeys));
+  if (!ukeys) {
+    return false;
+  }
+  size_t *counts = calloc(map->capacity, sizeof(*counts));
+  if (!counts) {
+    free(ukeys);
+    return false;
+  }
+  size_t i = 0;
+  for (i = 0; i < n; i++) {
+    ukeys[i] = _compute_key(map, keys[i]);
+    counts[ukeys[i].pkey & map->mask]++;
+  }
+  bool ok = true;
+  /* while an extension runs, bucket indexes are in flux: skip the
+   * pre-sizing, the inserts below still land correctly */
+  for (i = 0; map->ext_table == NULL && i < map->capacity && ok; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    _lock_bucket_index(map, i);
+    ok = _reserve_node(map, &map->table[i],
+                       map->table[i].count + counts[i]);
+    _unlock_bucket_index(map, i);
+  }
+  free(counts);
+  for (i = 0; i < n && ok; i++) {
+    ok = _set(map, ukeys[i], keys[i], strlen(keys[i]), values[i], 0);
+  }
+  free(ukeys);
+  return ok;
+}
+
+bool hashmap_set_batch(HashMap *map, const char **keys, const size_t *lens,
+                       void **values, size_t n) {
+  assert(map != NULL);
+  assert(keys != NULL);
+  assert(values != NULL);
+  HashMapBucketKey ukeys[HASH_MAP_BATCH_WINDOW];
+  size_t klens[HASH_MAP_BATCH_WINDOW];
+  size_t order[HASH_MAP_BATCH_WINDOW];
+  size_t done = 0;
+  while (done < n) {
+    size_t count = n - done;
+    if (count > HASH_MAP_BATCH_WINDOW) {
+      count = HASH_MAP_BATCH_WINDOW;
+    }
+    /* one extension step per window, so bucket routing stays stable
+     * between grouping and storing */
+    _extend_step(map, HASH_MAP_EXTEND_STEP);
+    size_t i = 0;
+    /* stage 1: hash everything, prefetch the primary buckets */
+    for (i = 0; i < count; i++) {
+      klens[i] = lens != NULL ? lens[done + i] : strlen(keys[done + i]);
+      ukeys[i] = hashmap_hash(map, keys[done + i], klens[i]);
+      PREFETCH(_locate(map, ukeys[i]));
+    }
+    /* stage 2: group the window by bucket (insertion sort over the bucket
+     * pointers), so each bucket is locked and grown once per window */
+    for (i = 0; i < count; i++) {
+      order[i] = i;
+    }
+    for (i = 1; i < count; i++) {
+      size_t o = order[i];
+      HashMapBucket *node = _locate(map, ukeys[o]);
+      size_t j = i;
+      while (j > 0 && _locate(map, ukeys[order[j - 1]]) > node) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = o;
+    }
+    /* stage 3: per bucket run: one lock, one growth decision, prefetched
+     * probe starts, then the stores */
+    bool ok = true;
+    i = 0;
+    while (i < count) {
+      HashMapBucket *node = _locate(map, ukeys[order[i]]);
+      size_t run = i + 1;
+      while (run < count && _locate(map, ukeys[order[run]]) == node) {
+        run++;
+      }
+      _lock_key(map, ukeys[order[i]]);
+      ok = _reserve_node(map, node, node->count + (run - i));
+      size_t j = 0;
+      for (j = i; j < run && ok; j++) {
+        if (node->capacity > 0 && node->items != NULL) {
+          PREFETCH(&node->items[ukeys[order[j]].skey & node->mask]);
+        }
+      }
+      for (j = i; j < run && ok; j++) {
+        size_t k = done + order[j];
+        /* the reserve above made growth a no-op branch in the common
+         * case; overwrites and tombstone reuse can still trip it */
+        ok = _grow_node_if_needed(map, ukeys[order[j]]) &&
+             _set_locked(map, ukeys[order[j]], keys[k], klens[order[j]],
+                         values[k], 0);
+      }
+      _unlock_key(map, ukeys[order[i]]);
+      if (!ok) {
+        return false;
+      }
+      i = run;
+    }
+    done += count;
+  }
+  return true;
+}
+
+bool hashmap_set_n(HashMap *map, const char *key, size_t len, void *data) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(len > 0);
+  return _set(map, hashmap_hash(map, key, len), key, len, data, 0);
+}
+
+bool hashmap_set(HashMap *map, const char *key, void *data) {
+  assert(key != NULL);
+  return hashmap_set_n(map, key, strlen(key), data);
+}
+
+bool hashmap_set_hashed(HashMap *map, HashMapBucketKey ukey, void *data) {
+  assert(map != NULL);
+  /* a verified map has no key bytes to store on this path */
+  assert(!map->verify_keys);
+  return _set(map, ukey, NULL, 0, data, 0);
+}
+
+bool hashmap_set_inline(HashMap *map, const char *key, const void *value) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(value != NULL);
+  assert(map->value_size > 0);
+  /* the value bytes are packed into the data slot, the rest of the write
+   * path is the regular one */
+  void *packed = NULL;
+  memcpy(&packed, value, map->value_size);
+  size_t len = strlen(key);
+  assert(len > 0);
+  return _set(map, hashmap_hash(map, key, len), key, len, packed, 0);
+}
+
+bool hashmap_set_ttl(HashMap *map, const char *key, void *data,
+                     uint64_t ttl_ms) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(data != NULL);
+  assert(map->expiring);
+  size_t len = strlen(key);
+  assert(len > 0);
+  uint64_t expiry = ttl_ms > 0 ? _now_ms() + ttl_ms : 0;
+  return _set(map, hashmap_hash(map, key, len), key, len, data, expiry);
+}
+
+bool hashmap_upsert(HashMap *map, const char *key,
+                    HashMapComputeFunction compute, void *ctx) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(compute != NULL);
+  size_t len = strlen(key);
+  assert(len > 0);
+  HashMapBucketKey ukey = hashmap_hash(map, key, len);
+  HashMapBucket *node = NULL;
+  _extend_step(map, HASH_MAP_EXTEND_STEP);
+  _lock_key(map, ukey);
+  if (!_grow_node_if_needed(map, ukey)) {
+    _unlock_key(map, ukey);
+    return false;
+  }
+  _migrate_step(map, _locate(map, ukey), HASH_MAP_MIGRATE_STEP);
+  if (map->incremental) {
+    HashMapBucket *mnode = _locate(map, ukey);
+    if (mnode->old_items != NULL) {
+      HashMapBucketItem *old = _find_in_old(map, mnode, ukey, key, len);
+      if (old != NULL) {
+        _reinsert_items(mnode->items, mnode->ctrl, mnode->capacity, old,
+                        &mnode->old_ctrl[old - mnode->old_items], 1);
+        mnode->old_ctrl[old - mnode->old_items] = CTRL_EMPTY;
+        memset(old, 0, sizeof(*old));
+      }
+    }
+  }
+  HashMapBucketItem *item = _get_item(map, ukey, key, len, true, &node);
+  if (!item) {
+    _unlock_key(map, ukey);
+    return false;
+  }
+  bool fresh = !_ctrl_live(node->ctrl[item - node->items]);
+  /* the callback owns the value transition, free_item is not called */
+  void *next = compute(fresh ? NULL : item->data, ctx);
+  if (map->value_size == 0 && next == NULL) {
+    /* a pointer map cannot store NULL, leave the slot untouched */
+    _unlock_key(map, ukey);
+    return false;
+  }
+  char *key_copy = NULL;
+  if (fresh) {
+    if (map->verify_keys) {
+      key_copy = malloc(len + 1);
+      if (!key_copy) {
+        _unlock_key(map, ukey);
+        return false;
+      }
+      memcpy(key_copy, key, len);
+      key_copy[len] = '\0';
+    }
+    if (node->ctrl[item - node->items] == CTRL_TOMB) {
+      node->tombs--;
+    }
+    node->count++;
+    __atomic_fetch_add(&map->_count, 1, __ATOMIC_RELAXED);
+  }
+  _write_begin(map, node);
+  item->key = ukey;
+  if (key_copy) {
+    item->key_str = key_copy;
+    item->key_len = len;
+  }
+  item->data = next;
+  node->ctrl[item - node->items] = _h2(ukey);
+  _write_end(map, node);
+  _unlock_key(map, ukey);
+  return true;
+}
+
+static void *_get(HashMap *map, HashMapBucketKey ukey, const char *kstr,
+                  size_t klen) {
+  if (map->read_mostly) {
+    /* lock-free read: probe a snapshot of the bucket, then check the seqlock
+     * version; if a writer touched the bucket meanwhile, probe again */
+    HashMapBucket *node = _locate(map, ukey);
+    for (;;) {
+      uint32_t version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+      if (version & 1) {
+        continue;
+      }
+      HashMapBucketItem *items =
+          __atomic_load_n(&node->items, __ATOMIC_ACQUIRE);
+      size_t capacity = __atomic_load_n(&node->capacity, __ATOMIC_RELAXED);
+      size_t mask = capacity - 1;
+      /* a resize stores items and capacity separately: revalidate the
+       * version before probing, so a torn pair (old array, new capacity)
+       * can never index past the allocation. _write_begin makes the
+       * version odd before any field store, so an unchanged even version
+       * means the snapshot is consistent. */
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) != version) {
+        continue;
+      }
+      void *data = NULL;
+      if (items != NULL && capacity > 0) {
+        size_t idx = ukey.skey & mask;
+        size_t i = 0;
+        for (i = 0; i < capacity; i++) {
+          HashMapBucketItem *item = &items[(idx + i) & mask];
+          if (_item_matches(map, item, ukey, kstr, klen)) {
+            data = item->data;
+            break;
+          }
+        }
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) == version) {
+        return data;
+      }
+    }
+  }
+  _extend_step(map, HASH_MAP_EXTEND_STEP);
+  _lock_key(map, ukey);
+  HashMapBucket *node = _locate(map, ukey);
+  _migrate_step(map, node, HASH_MAP_MIGRATE_STEP);
+  HashMapBucketItem *item = _get_item(map, ukey, kstr, klen, false, NULL);
+  if (item == NULL && map->incremental && node->old_items != NULL) {
+    item = _find_in_old(map, node, ukey, kstr, klen);
+  }
+  void *data = item ? item->data : NULL;
+  _unlock_key(map, ukey);
+  return data;
+}
+
+void *hashmap_get_n(HashMap *map, const char *key, size_t len) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(len > 0);
+  return _get(map, hashmap_hash(map, key, len), key, len);
+}
+
+void *hashmap_get(HashMap *map, const char *key) {
+  assert(key != NULL);
+  return hashmap_get_n(map, key, strlen(key));
+}
+
+void *hashmap_get_hashed(HashMap *map, HashMapBucketKey ukey) {
+  assert(map != NULL);
+  return _get(map, ukey, NULL, 0);
+}
+
+bool hashmap_get_inline(HashMap *map, const char *key, void *value) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(map->value_size > 0);
+  size_t len = strlen(key);
+  assert(len > 0);
+  HashMapBucketKey ukey = hashmap_hash(map, key, len);
+  _extend_step(map, HASH_MAP_EXTEND_STEP);
+  _lock_key(map, ukey);
+  HashMapBucket *node = _locate(map, ukey);
+  _migrate_step(map, node, HASH_MAP_MIGRATE_STEP);
+  HashMapBucketItem *item = _get_item(map, ukey, key, len, false, NULL);
+  if (item == NULL && map->incremental && node->old_items != NULL) {
+    item = _find_in_old(map, node, ukey, key, len);
+  }
+  if (item != NULL && value != NULL) {
+    memcpy(value, &item->data, map->value_size);
+  }
+  _unlock_key(map, ukey);
+  return item != NULL;
+}
+
+void hashmap_get_batch(HashMap *map, const char **keys, size_t n, void **out) {
+  assert(map != NULL);
+  assert(keys != NULL);
+  assert(out != NULL);
+  HashMapBucketKey ukeys[HASH_MAP_BATCH_WINDOW];
+  size_t klens[HASH_MAP_BATCH_WINDOW];
+  size_t done = 0;
+  while (done < n) {
+    size_t count = n - done;
+    if (count > HASH_MAP_BATCH_WINDOW) {
+      count = HASH_MAP_BATCH_WINDOW;
+    }
+    size_t i = 0;
+    /* stage 1: hash everything, prefetch the primary buckets */
+    for (i = 0; i < count; i++) {
+      klens[i] = strlen(keys[done + i]);
+      ukeys[i] = hashmap_hash(map, keys[done + i], klens[i]);
+      PREFETCH(_locate(map, ukeys[i]));
+    }
+    /* stage 2: buckets are (hopefully) in cache now, prefetch the probe
+     * start inside each item array */
+    for (i = 0; i < count; i++) {
+      HashMapBucket *node = _locate(map, ukeys[i]);
+      if (node->capacity > 0 && node->items != NULL) {
+        PREFETCH(&node->items[ukeys[i].skey & node->mask]);
+      }
+    }
+    /* stage 3: probe, both cache levels should be warm; the key bytes go
+     * along so verified maps memcmp exactly as hashmap_get does */
+    for (i = 0; i < count; i++) {
+      out[done + i] = _get(map, ukeys[i], keys[done + i], klens[i]);
+    }
+    done += count;
+  }
+}
+
+/* rebuild a bucket at its current capacity, dropping its tombstones.
+ * Inline buckets are left alone (a handful of slots is cheap to scan) and
+ * so are buckets with a migration pending. Caller holds the lock. */
+static bool _compact_node(HashMap *map, HashMapBucket *node) {
+  if (node->capacity == 0 || node->tombs == 0 || node->old_items != NULL ||
+      _bucket_inline(node)) {
+    return true;
+  }
+  if (!_unshare_node(map, node)) {
+    return false;
+  }
+  HashMapBucketItem *items = _items_alloc(map, node->capacity);
+  if (!items) {
+    return false;
+  }
+  uint8_t *ctrl = _ctrl_alloc(map, node->capacity);
+  if (!ctrl) {
+    _items_free(map, items, node->capacity);
+    return false;
+  }
+  _reinsert_items(items, ctrl, node->capacity, node->items, node->ctrl,
+                  node->capacity);
+  void *tmp = node->items;
+  void *tmp_ctrl = node->ctrl;
+  bool owned = !_in_snapshot(map, tmp);
+  _write_begin(map, node);
+  node->items = items;
+  node->ctrl = ctrl;
+  _write_end(map, node);
+  if (owned) {
+    if (map->read_mostly) {
+      _retire(map, tmp);
+      _retire(map, tmp_ctrl);
+    } else {
+      _items_free(map, tmp, node->capacity);
+      _ctrl_free(map, tmp_ctrl, node->capacity);
+    }
+  }
+  node->tombs = 0;
+  node->generation++;
+  return true;
+}
+
+size_t hashmap_compact(HashMap *map) {
+  assert(map != NULL);
+  size_t rewritten = 0;
+  size_t i = 0;
+  for (i = 0; i < map->capacity; i++) {
+    _lock_bucket_index(map, i);
+    HashMapBucket *node = &map->table[i];
+    if (node->tombs * HASH_MAP_TOMB_RATIO > node->capacity &&
+        _compact_node(map, node)) {
+      rewritten++;
+    }
+    _unlock_bucket_index(map, i);
+  }
+  /* extending maps are single-threaded, no locks needed on the new table */
+  for (i = 0; map->ext_table != NULL && i < map->ext_capacity; i++) {
+    HashMapBucket *node = &map->ext_table[i];
+    if (node->tombs * HASH_MAP_TOMB_RATIO > node->capacity &&
+        _compact_node(map, node)) {
+      rewritten++;
+    }
+  }
+  return rewritten;
+}
+
+size_t hashmap_shrink_to_fit(HashMap *map) {
+  assert(map != NULL);
+  size_t reclaimed = 0;
+  size_t min_capacity = _min_bucket_capacity(map);
+  /* a shrink while a table extension runs trims both tables */
+  size_t buckets =
+      map->capacity + (map->ext_table != NULL ? map->ext_capacity : 0);
+  size_t i = 0;
+  for (i = 0; i < buckets; i++) {
+    _lock_bucket_index(map, i);
+    HashMapBucket *node = i < map->capacity
+                              ? &map->table[i]
+                              : &map->ext_table[i - map->capacity];
+    /* migrating buckets keep their arrays until the drain frees them, and
+     * snapshot-backed arrays cost nothing to keep but heap to replace */
+    if (node->old_items != NULL || _bucket_inline(node) ||
+        node->capacity == 0 || _in_snapshot(map, node->items)) {
+      _unlock_bucket_index(map, i);
+      continue;
+    }
+    size_t need = _round_up_pow2(node->count);
+    if (need < min_capacity) {
+      need = min_capacity;
+    }
+    if (need >= node->capacity) {
+      _unlock_bucket_index(map, i);
+      continue;
+    }
+    size_t before =
+        node->capacity * sizeof(*node->items) + _ctrl_size(node->capacity);
+    if (_unshare_node(map, node) && _shrink_node_to(map, node, need)) {
+      size_t after = 0;
+      if (!_bucket_inline(node)) {
+        after = node->capacity * sizeof(*node->items) +
+                _ctrl_size(node->capacity);
+      }
+      reclaimed += before - after;
+    }
+    _unlock_bucket_index(map, i);
+  }
+  return reclaimed;
+}
+
+bool hashmap_extend(HashMap *map, size_t capacity) {
+  assert(map != NULL);
+  assert(capacity > 0);
+  /* a key's lock stripe would change tables mid-migration, and the
+   * lock-free read path cannot chase two tables */
+  assert(map->locks == NULL);
+  assert(!map->read_mostly);
+  if (map->ext_table != NULL) {
+    return false;
+  }
+  capacity = _round_up_pow2(capacity);
+  if (capacity <= map->capacity) {
+    return true;
+  }
+  HashMapBucket *table = calloc(capacity, sizeof(*table));
+  if (table == NULL) {
+    return false;
+  }
+  map->ext_table = table;
+  map->ext_capacity = capacity;
+  map->ext_mask = capacity - 1;
+  map->ext_pos = 0;
+  return true;
+}
+
+size_t hashmap_evict_expired(HashMap *map, size_t max_buckets) {
+  assert(map != NULL);
+  if (!map->expiring) {
+    return 0;
+  }
+  /* an extending map is swept across both tables, the sum of two powers
+   * of two is none, so the cursor wraps with a modulo */
+  size_t buckets =
+      map->capacity + (map->ext_table != NULL ? map->ext_capacity : 0);
+  if (max_buckets == 0 || max_buckets > buckets) {
+    max_buckets = buckets;
+  }
+  uint64_t now = _now_ms();
+  size_t evicted = 0;
+  size_t b = 0;
+  for (b = 0; b < max_buckets; b++) {
+    size_t i = (map->_evict_pos + b) % buckets;
+    _lock_bucket_index(map, i);
+    HashMapBucket *node = i < map->capacity
+                              ? &map->table[i]
+                              : &map->ext_table[i - map->capacity];
+    size_t j = 0;
+    for (j = 0; j < node->capacity; j++) {
+      if (_ctrl_live(node->ctrl[j]) && node->items[j].expiry != 0 &&
+          node->items[j].expiry <= now) {
+        _reclaim_expired(map, node, &node->items[j], &node->ctrl[j], false);
+        evicted++;
+      }
+    }
+    /* items a pending migration has not moved yet */
+    for (j = 0; j < node->old_capacity; j++) {
+      if (_ctrl_live(node->old_ctrl[j]) && node->old_items[j].expiry != 0 &&
+          node->old_items[j].expiry <= now) {
+        _reclaim_expired(map, node, &node->old_items[j], &node->old_ctrl[j],
+                         true);
+        evicted++;
+      }
+    }
+    _unlock_bucket_index(map, i);
+  }
+  map->_evict_pos = (map->_evict_pos + max_buckets) % buckets;
+  return evicted;
+}
+
+/* resolve a handle to its item, using the cached slot when the bucket
+ * generation still matches and the slot still holds the handle's key;
+ * otherwise re-probe and refresh the cache. Caller holds the lock. */
+static HashMapBucketItem *_entry_item(HashMapEntry *entry) {
+  HashMap *map = entry->map;
+  HashMapBucket *node = _locate(map, entry->key);
+  if (entry->slot != SIZE_MAX && entry->generation == node->generation &&
+      entry->slot < node->capacity &&
+      node->ctrl[entry->slot] == _h2(entry->key) &&
+      _item_matches(map, &node->items[entry->slot], entry->key,
+                    entry->key_str, entry->key_len) &&
+      !_expired(map, &node->items[entry->slot])) {
+    return &node->items[entry->slot];
   }
-  return NULL;
+  entry->slot = SIZE_MAX;
+  HashMapBucketItem *item = _get_item(map, entry->key, entry->key_str,
+                                      entry->key_len, false, &node);
+  if (item != NULL) {
+    entry->slot = (size_t)(item - node->items);
+    entry->generation = node->generation;
+  } else if (map->incremental && node->old_items != NULL) {
+    /* not migrated yet: usable for this access, but its position in the
+     * old arrays is not worth caching */
+    item = _find_in_old(map, node, entry->key, entry->key_str,
+                        entry->key_len);
+  }
+  return item;
 }
 
-static bool _shrink_node_if_needed(HashMap *map, HashMapBucketKey key) {
+HashMapEntry hashmap_find(HashMap *map, const char *key) {
   assert(map != NULL);
-  HashMapBucket *node = &map->table[key.pkey % map->capacity];
-  /* no reduction needed, just remap keys */
-  if (node->capacity == HASH_MAP_BUCKET_SIZE ||
-      node->count > node->capacity * (1 - HASH_MAP_LOAD_FACTOR)) {
-    if (map->_tmp_capacity < node->capacity) {
-      void *tmp2 = realloc(map->_tmp, node->capacity * sizeof(*node->items));
-      if (!tmp2) {
-        return false;
-      }
-      map->_tmp = tmp2;
-      map->_tmp_capacity = node->capacity;
-    }
+  assert(key != NULL);
+  size_t len = strlen(key);
+  assert(len > 0);
+  HashMapEntry entry = {.map = map,
+                        .key_str = key,
+                        .key_len = len,
+                        .key = hashmap_hash(map, key, len),
+                        .slot = SIZE_MAX,
+                        .generation = 0};
+  _lock_key(map, entry.key);
+  _entry_item(&entry);
+  _unlock_key(map, entry.key);
+  return entry;
+}
 
-    memcpy(map->_tmp, node->items, node->capacity * (sizeof(*node->items)));
-    memset(node->items, 0, node->capacity * (sizeof(*node->items)));
+void *hashmap_entry_value(HashMapEntry *entry) {
+  assert(entry != NULL);
+  assert(entry->map != NULL);
+  _lock_key(entry->map, entry->key);
+  HashMapBucketItem *item = _entry_item(entry);
+  void *data = item != NULL ? item->data : NULL;
+  _unlock_key(entry->map, entry->key);
+  return data;
+}
 
-    size_t i = 0;
-    for (i = 0; i < node->capacity; i++) {
-      if (map->_tmp[i].data == NULL) {
-        continue;
-      }
-      size_t idx = map->_tmp[i].key.skey % node->capacity;
-      size_t j = 0;
-      for (j = 0; j < node->capacity; j++) {
-        if (node->items[(idx + j) % node->capacity].data == NULL) {
-          memcpy(&node->items[(idx + j) % node->capacity], &map->_tmp[i],
-                 sizeof(*node->items));
-          break;
-        }
-      }
+bool hashmap_entry_set(HashMapEntry *entry, void *data) {
+  assert(entry != NULL);
+  assert(entry->map != NULL);
+  HashMap *map = entry->map;
+  _lock_key(map, entry->key);
+  if (!_unshare_node(map, _locate(map, entry->key))) {
+    _unlock_key(map, entry->key);
+    return false;
+  }
+  HashMapBucketItem *item = _entry_item(entry);
+  if (item != NULL) {
+    if (map->free_item && item->data != data) {
+      map->free_item(item->data);
     }
+    HashMapBucket *node = _locate(map, entry->key);
+    _write_begin(map, node);
+    item->data = data;
+    _write_end(map, node);
+    _unlock_key(map, entry->key);
     return true;
   }
+  _unlock_key(map, entry->key);
+  /* the key is gone (or never was there): insert it through the regular
+   * write path, then re-cache its slot */
+  if (!_set(map, entry->key, entry->key_str, entry->key_len, data, 0)) {
+    return false;
+  }
+  _lock_key(map, entry->key);
+  _entry_item(entry);
+  _unlock_key(map, entry->key);
+  return true;
+}
 
-  /* We reduce the size of the bucket by creating a new items array */
-  size_t new_capacity = node->capacity / 2;
-  HashMapBucketItem *items = calloc(new_capacity, sizeof(*items));
-  if (items == NULL) {
+static bool _delete(HashMap *map, HashMapBucketKey ukey, const char *kstr,
+                    size_t klen, void **data) {
+  _extend_step(map, HASH_MAP_EXTEND_STEP);
+  _lock_key(map, ukey);
+  HashMapBucket *node = NULL;
+  _migrate_step(map, _locate(map, ukey), HASH_MAP_MIGRATE_STEP);
+  HashMapBucketItem *item = _get_item(map, ukey, kstr, klen, false, &node);
+  bool in_old = false;
+  if (!item && map->incremental && node->old_items != NULL) {
+    /* not migrated yet, remove it straight from the old arrays */
+    item = _find_in_old(map, node, ukey, kstr, klen);
+    in_old = item != NULL;
+  }
+  if (!item) {
+    _unlock_key(map, ukey);
     return false;
   }
+  if (data != NULL) {
+    *data = item->data;
+  }
+  if (!in_old) {
+    /* the copy keeps slot positions, only the arrays move */
+    size_t slot = (size_t)(item - node->items);
+    if (!_unshare_node(map, node)) {
+      _unlock_key(map, ukey);
+      return false;
+    }
+    item = &node->items[slot];
+  }
+  if (map->verify_keys && !_in_snapshot(map, item->key_str)) {
+    free(item->key_str);
+  }
+  _write_begin(map, node);
+  if (in_old) {
+    /* old arrays are scanned in full, holes are fine there */
+    node->old_ctrl[item - node->old_items] = CTRL_EMPTY;
+    memset(item, 0, sizeof(*item));
+  } else {
+    /* O(1) delete: leave a tombstone, probes walk through it, inserts
+     * reuse it and compaction reclaims it off the delete path */
+    size_t pos = (size_t)(item - node->items);
+    node->ctrl[pos] = CTRL_TOMB;
+    memset(&node->items[pos], 0, sizeof(node->items[pos]));
+    node->tombs++;
+  }
+  _write_end(map, node);
+  node->count--;
+  __atomic_fetch_sub(&map->_count, 1, __ATOMIC_RELAXED);
+  bool ret = true;
+  if (node->count > 0) {
+    ret = _shrink_node_if_needed(map, ukey);
+  }
+  _unlock_key(map, ukey);
+  return ret;
+}
+
+bool hashmap_delete_n(HashMap *map, const char *key, size_t len,
+                      void **data) {
+  assert(map != NULL);
+  assert(key != NULL);
+  assert(len > 0);
+  return _delete(map, hashmap_hash(map, key, len), key, len, data);
+}
+
+bool hashmap_delete(HashMap *map, const char *key, void **data) {
+  assert(key != NULL);
+  return hashmap_delete_n(map, key, strlen(key), data);
+}
+
+bool hashmap_delete_hashed(HashMap *map, HashMapBucketKey ukey, void **data) {
+  assert(map != NULL);
+  return _delete(map, ukey, NULL, 0, data);
+}
 
+void hashmap_iterate(HashMap *map, HashMapIterateItemFunction callback) {
   size_t i = 0;
-  for (i = 0; i < node->capacity; i++) {
-    if (node->items[i].data == NULL) {
+  for (i = 0; i < map->capacity; i++) {
+    _lock_bucket_index(map, i);
+    if (map->table[i].capacity == 0) {
+      _unlock_bucket_index(map, i);
       continue;
     }
-    size_t idx = node->items[i].key.skey % new_capacity;
     size_t j = 0;
-    for (j = 0; j < new_capacity; j++) {
-      if (items[(idx + j) % new_capacity].data == NULL) {
-        memcpy(&items[(idx + j) % new_capacity], &node->items[i],
-               sizeof(*node->items));
-        break;
+    for (j = 0; j < map->table[i].capacity; j++) {
+      if (_ctrl_live(map->table[i].ctrl[j])) {
+        callback((map->table[i].items[j].key), map->table[i].items[j].data);
+      }
+    }
+    /* items a pending migration has not moved yet */
+    for (j = 0; j < map->table[i].old_capacity; j++) {
+      if (_ctrl_live(map->table[i].old_ctrl[j])) {
+        callback((map->table[i].old_items[j].key),
+                 map->table[i].old_items[j].data);
+      }
+    }
+    _unlock_bucket_index(map, i);
+  }
+  /* buckets already moved by a running table extension (extending maps are
+   * single-threaded, and new-table buckets never migrate themselves) */
+  for (i = 0; map->ext_table != NULL && i < map->ext_capacity; i++) {
+    HashMapBucket *node = &map->ext_table[i];
+    size_t j = 0;
+    for (j = 0; j < node->capacity; j++) {
+      if (_ctrl_live(node->ctrl[j])) {
+        callback(node->items[j].key, node->items[j].data);
       }
     }
   }
-
-  void *tmp = node->items;
-  node->items = items;
-  node->capacity = new_capacity;
-  free(tmp);
-  return true;
 }
 
-static bool _grow_node_if_needed(HashMap *map, HashMapBucketKey key) {
-  HashMapBucket *node = &map->table[key.pkey % map->capacity];
-  if (node->count + 1 < node->capacity * HASH_MAP_LOAD_FACTOR) {
-    return true;
-  }
+size_t hashmap_count(HashMap *map) {
+  assert(map != NULL);
+  return __atomic_load_n(&map->_count, __ATOMIC_RELAXED);
+}
 
-  size_t new_capacity =
-      (node->capacity == 0 ? HASH_MAP_BUCKET_SIZE : (node->capacity * 2));
-  size_t new_size = new_capacity * sizeof(*node->items);
-  if (node->capacity > 0) {
-    if (map->_tmp_capacity < node->capacity) {
-      void *tmp2 = realloc(map->_tmp, node->capacity * sizeof(*map->_tmp));
-      if (!tmp2) {
-        /* we don't realloc here, extra size is ok */
-        return false;
+void hashmap_stats(HashMap *map, HashMapStats *stats) {
+  assert(map != NULL);
+  assert(stats != NULL);
+  memset(stats, 0, sizeof(*stats));
+  /* while a table extension runs, the report spans both tables */
+  size_t buckets =
+      map->capacity + (map->ext_table != NULL ? map->ext_capacity : 0);
+  stats->buckets = buckets;
+  size_t total_probe = 0;
+  size_t probed_items = 0;
+  size_t i = 0;
+  for (i = 0; i < buckets; i++) {
+    _lock_bucket_index(map, i);
+    HashMapBucket *node = i < map->capacity
+                              ? &map->table[i]
+                              : &map->ext_table[i - map->capacity];
+    stats->count += node->count;
+    if (node->count == 0) {
+      stats->empty_buckets++;
+    }
+    if (node->count > stats->max_bucket_count) {
+      stats->max_bucket_count = node->count;
+    }
+    size_t bin = node->count < HASH_MAP_STATS_BINS ? node->count
+                                                   : HASH_MAP_STATS_BINS;
+    stats->occupancy_histogram[bin]++;
+    if (node->capacity > 0 && !_bucket_inline(node)) {
+      stats->allocated_bytes +=
+          node->capacity * sizeof(*node->items) + _ctrl_size(node->capacity);
+      /* slack: what hashmap_shrink_to_fit would return right now */
+      if (node->old_items == NULL && !_in_snapshot(map, node->items)) {
+        size_t need = _round_up_pow2(node->count);
+        size_t min_capacity = _min_bucket_capacity(map);
+        if (need < min_capacity) {
+          need = min_capacity;
+        }
+        if (need < node->capacity) {
+          size_t after = need * sizeof(*node->items) + _ctrl_size(need);
+#if HASH_MAP_BUCKET_INLINE > 0
+          if (need <= HASH_MAP_BUCKET_INLINE) {
+            /* small enough to move back into the bucket itself */
+            after = 0;
+          }
+#endif
+          stats->slack_bytes += node->capacity * sizeof(*node->items) +
+                                _ctrl_size(node->capacity) - after;
+        }
       }
-      map->_tmp = tmp2;
-      map->_tmp_capacity = node->capacity;
     }
-
-    memcpy(map->_tmp, node->items, sizeof(*node->items) * node->capacity);
-    void *tmp = realloc(node->items, new_size);
-    if (!tmp) {
-      return false;
+    if (node->old_items != NULL) {
+      stats->allocated_bytes += node->old_capacity * sizeof(*node->items) +
+                                _ctrl_size(node->old_capacity);
     }
-
-    size_t old_capacity = node->capacity;
-    node->items = tmp;
-    node->capacity = new_capacity;
-    memset(node->items, 0, sizeof(*node->items) * node->capacity);
-    size_t i = 0;
+    /* probe length of an item is its displacement from its home slot */
     size_t j = 0;
-    for (i = 0; i < old_capacity; i++) {
-      size_t idx = map->_tmp[i].key.skey % node->capacity;
-      for (j = 0; j < node->capacity; j++) {
-        if (node->items[(idx + j) % node->capacity].data == NULL) {
-          memcpy(&node->items[(idx + j) % node->capacity], &map->_tmp[i],
-                 sizeof(map->_tmp[i]));
-          break;
-        }
+    for (j = 0; j < node->capacity; j++) {
+      if (!_ctrl_live(node->ctrl[j])) {
+        continue;
+      }
+      size_t probe =
+          ((j - (node->items[j].key.skey & node->mask)) & node->mask) + 1;
+      total_probe += probe;
+      probed_items++;
+      if (probe > stats->max_probe_length) {
+        stats->max_probe_length = probe;
       }
     }
-  } else {
-    node->items = calloc(new_capacity, sizeof(*node->items));
-    if (!node->items) {
-      return false;
+    _unlock_bucket_index(map, i);
+  }
+  if (stats->buckets > 0) {
+    stats->empty_ratio = (double)stats->empty_buckets / stats->buckets;
+  }
+  if (probed_items > 0) {
+    stats->mean_probe_length = (double)total_probe / probed_items;
+  }
+  /* overload detector: the threshold needs the mean, so the flagging is a
+   * second (count-only) pass. Buckets below the initial bucket_size never
+   * trip it, a handful of items is no flood. */
+  if (stats->buckets > 0 && stats->count > 0) {
+    double threshold =
+        map->config.overload_factor * ((double)stats->count / stats->buckets);
+    for (i = 0; i < buckets; i++) {
+      _lock_bucket_index(map, i);
+      HashMapBucket *node = i < map->capacity
+                                ? &map->table[i]
+                                : &map->ext_table[i - map->capacity];
+      if ((double)node->count > threshold &&
+          node->count > map->config.bucket_size) {
+        stats->overloaded_buckets++;
+      }
+      _unlock_bucket_index(map, i);
     }
-    node->capacity = new_capacity;
   }
+}
 
-  return true;
+HashMapIter hashmap_iter(HashMap *map) {
+  assert(map != NULL);
+  HashMapIter it = {.map = map, .bucket = 0, .slot = 0};
+  return it;
 }
 
-static HashMapBucketKey _compute_key(HashMap *map, const char *key) {
-  size_t key_len = strlen(key);
-  assert(key_len > 0);
-  uint64_t ukey = map->hash_function(key, key_len);
-  HashMapBucketKey k = {.pkey = (uint32_t)(ukey & 0xFFFFFFFF),
-                        .skey = (uint32_t)(ukey >> 32)};
-  return k;
+bool hashmap_iter_next(HashMapIter *it, HashMapBucketKey *key, void **data) {
+  assert(it != NULL);
+  assert(it->map != NULL);
+  HashMap *map = it->map;
+  size_t buckets =
+      map->capacity + (map->ext_table != NULL ? map->ext_capacity : 0);
+  while (it->bucket < buckets) {
+    _lock_bucket_index(map, it->bucket);
+    /* the new table of a running extension trails the old one in the
+     * cursor space */
+    HashMapBucket *node = it->bucket < map->capacity
+                              ? &map->table[it->bucket]
+                              : &map->ext_table[it->bucket - map->capacity];
+    /* the old arrays of a pending migration trail the live ones */
+    size_t total = node->capacity + node->old_capacity;
+    while (it->slot < total) {
+      bool live =
+          it->slot < node->capacity
+              ? _ctrl_live(node->ctrl[it->slot])
+              : _ctrl_live(node->old_ctrl[it->slot - node->capacity]);
+      HashMapBucketItem *item =
+          it->slot < node->capacity
+              ? &node->items[it->slot]
+              : &node->old_items[it->slot - node->capacity];
+      it->slot++;
+      if (live) {
+        if (key != NULL) {
+          *key = item->key;
+        }
+        if (data != NULL) {
+          *data = item->data;
+        }
+        _unlock_bucket_index(map, it->bucket);
+        return true;
+      }
+    }
+    _unlock_bucket_index(map, it->bucket);
+    it->bucket++;
+    it->slot = 0;
+  }
+  return false;
 }
 
-/* Public API */
-HashMap *hashmap_create(size_t capacity, HashMapHashFunction hash_function,
-                        HashMapFreeItemFunction free_item) {
-  assert(capacity > 0);
-  assert(hash_function != NULL);
-  HashMap *map = calloc(1, sizeof(*map) + (sizeof(*map->table) * capacity));
-  if (map) {
-    map->table = (HashMapBucket *)(((void *)map) + sizeof(*map));
-    map->capacity = capacity;
-    map->free_item = free_item;
-    map->hash_function = hash_function;
+size_t hashmap_iterate_bounded(HashMapIter *it,
+                               HashMapIterateItemFunction callback,
+                               size_t max_items) {
+  assert(it != NULL);
+  assert(callback != NULL);
+  size_t n = 0;
+  HashMapBucketKey key;
+  void *data = NULL;
+  while (n < max_items && hashmap_iter_next(it, &key, &data)) {
+    callback(key, data);
+    n++;
   }
-  return map;
+  return n;
 }
 
-bool hashmap_set(HashMap *map, const char *key, void *data) {
+/* snapshot file layout: header, primary table of HashMapBucket structs
+ * whose array pointers hold file offsets, then the item and control arrays,
+ * then the key bytes of verified maps */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t flags;
+  /* struct sizes depend on the compile-time layout knobs, reject a file
+   * written by a differently configured build */
+  uint64_t bucket_size;
+  uint64_t item_size;
+  uint64_t total_size;
+  /* the stored pkey/skey pairs were computed with this per-map seed, the
+   * loaded map must keep hashing with it */
+  uint64_t seed;
+} HashMapSnapHeader;
+
+#define SNAP_MAGIC 0x50414d48u /* "HMAP" */
+#define SNAP_VERSION 2
+#define SNAP_FLAG_VERIFIED (1u << 0)
+
+static bool _write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+bool hashmap_save(HashMap *map, int fd) {
   assert(map != NULL);
-  assert(key != NULL);
-  HashMapBucket *node = NULL;
-  HashMapBucketKey ukey = _compute_key(map, key);
-  if (!_grow_node_if_needed(map, ukey)) {
-    return false;
+  assert(fd >= 0);
+  size_t i = 0;
+  size_t j = 0;
+  /* the snapshot walks one table: complete a running extension first */
+  if (map->ext_table != NULL) {
+    _extend_step(map, map->capacity - map->ext_pos + 1);
+    if (map->ext_table != NULL) {
+      return false; /* allocation failure mid-migration */
+    }
   }
-  HashMapBucketItem *item = _get_item(map, ukey, true, &node);
-  if (!item) {
+  /* finish pending migrations so only the live arrays need saving */
+  for (i = 0; i < map->capacity; i++) {
+    _migrate_drain(map, &map->table[i]);
+  }
+  /* place the arrays and measure the key bytes region */
+  uint64_t arrays_off =
+      sizeof(HashMapSnapHeader) + map->capacity * sizeof(HashMapBucket);
+  uint64_t keys_off = arrays_off;
+  uint64_t key_bytes = 0;
+  size_t max_capacity = 0;
+  for (i = 0; i < map->capacity; i++) {
+    HashMapBucket *node = &map->table[i];
+    if (node->capacity == 0) {
+      continue;
+    }
+    keys_off += node->capacity * sizeof(HashMapBucketItem) +
+                _ctrl_size(node->capacity);
+    if (node->capacity > max_capacity) {
+      max_capacity = node->capacity;
+    }
+    if (map->verify_keys) {
+      for (j = 0; j < node->capacity; j++) {
+        if (_ctrl_live(node->ctrl[j])) {
+          key_bytes += node->items[j].key_len + 1;
+        }
+      }
+    }
+  }
+
+  HashMapSnapHeader header = {.magic = SNAP_MAGIC,
+                              .version = SNAP_VERSION,
+                              .capacity = map->capacity,
+                              .flags = map->verify_keys ? SNAP_FLAG_VERIFIED
+                                                        : 0,
+                              .bucket_size = sizeof(HashMapBucket),
+                              .item_size = sizeof(HashMapBucketItem),
+                              .total_size = keys_off + key_bytes,
+                              .seed = map->seed};
+  if (!_write_all(fd, &header, sizeof(header))) {
     return false;
   }
-  if (item->data == NULL) {
-    node->count++;
-  } else {
-    if (map->free_item) {
-      map->free_item(item->data);
-      item->data = NULL;
+
+  /* descriptors, with offsets where the fixup on load expects pointers */
+  uint64_t cursor = arrays_off;
+  for (i = 0; i < map->capacity; i++) {
+    HashMapBucket desc = map->table[i];
+    desc.version = 0;
+    desc.shares = NULL;
+    if (desc.capacity > 0) {
+      desc.items = (HashMapBucketItem *)cursor;
+      cursor += desc.capacity * sizeof(HashMapBucketItem);
+      desc.ctrl = (uint8_t *)cursor;
+      cursor += _ctrl_size(desc.capacity);
+    } else {
+      desc.items = NULL;
+      desc.ctrl = NULL;
+    }
+    if (!_write_all(fd, &desc, sizeof(desc))) {
+      return false;
     }
   }
-  item->data = data;
-  item->key = ukey;
 
+  /* item and control arrays; key_str pointers become offsets into the key
+   * bytes region, assigned in the same order the region is written below */
+  HashMapBucketItem *copy = NULL;
+  if (max_capacity > 0) {
+    copy = malloc(max_capacity * sizeof(*copy));
+    if (copy == NULL) {
+      return false;
+    }
+  }
+  uint64_t key_cursor = keys_off;
+  for (i = 0; i < map->capacity; i++) {
+    HashMapBucket *node = &map->table[i];
+    if (node->capacity == 0) {
+      continue;
+    }
+    memcpy(copy, node->items, node->capacity * sizeof(*copy));
+    if (map->verify_keys) {
+      for (j = 0; j < node->capacity; j++) {
+        if (_ctrl_live(node->ctrl[j])) {
+          copy[j].key_str = (char *)key_cursor;
+          key_cursor += copy[j].key_len + 1;
+        }
+      }
+    }
+    if (!_write_all(fd, copy, node->capacity * sizeof(*copy)) ||
+        !_write_all(fd, node->ctrl, _ctrl_size(node->capacity))) {
+      free(copy);
+      return false;
+    }
+  }
+  free(copy);
+
+  if (map->verify_keys) {
+    for (i = 0; i < map->capacity; i++) {
+      HashMapBucket *node = &map->table[i];
+      for (j = 0; j < node->capacity; j++) {
+        if (_ctrl_live(node->ctrl[j]) &&
+            !_write_all(fd, node->items[j].key_str,
+                        node->items[j].key_len + 1)) {
+          return false;
+        }
+      }
+    }
+  }
   return true;
 }
 
-void *hashmap_get(HashMap *map, const char *key) {
-  assert(map != NULL);
-  assert(key != NULL);
-  HashMapBucketKey ukey = _compute_key(map, key);
-  HashMapBucketItem *item = _get_item(map, ukey, false, NULL);
-  if (!item) {
+HashMap *hashmap_load(int fd, HashMapHashFunction hash_function,
+                      HashMapFreeItemFunction free_item) {
+  assert(fd >= 0);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HashMapSnapHeader)) {
+    return NULL;
+  }
+  /* copy-on-write mapping: deletes and overwrites dirty pages privately,
+   * the file itself is never modified */
+  void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  HashMapSnapHeader *header = base;
+  if (header->magic != SNAP_MAGIC || header->version != SNAP_VERSION ||
+      header->bucket_size != sizeof(HashMapBucket) ||
+      header->item_size != sizeof(HashMapBucketItem) ||
+      header->total_size != (uint64_t)st.st_size || header->capacity == 0 ||
+      (header->capacity & (header->capacity - 1)) != 0 ||
+      sizeof(HashMapSnapHeader) + header->capacity * sizeof(HashMapBucket) >
+          header->total_size) {
+    munmap(base, (size_t)st.st_size);
     return NULL;
   }
-  return item->data;
-}
 
-bool hashmap_delete(HashMap *map, const char *key, void **data) {
-  assert(map != NULL);
-  assert(key != NULL);
-  HashMapBucketKey ukey = _compute_key(map, key);
-  HashMapBucket *node = &map->table[ukey.pkey % map->capacity];
-  size_t idx = ukey.skey % node->capacity;
+  HashMap *map = calloc(1, sizeof(*map));
+  if (map == NULL) {
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+  }
+  map->table = (HashMapBucket *)((char *)base + sizeof(HashMapSnapHeader));
+  map->capacity = header->capacity;
+  map->mask = header->capacity - 1;
+  map->config.bucket_size = HASH_MAP_BUCKET_SIZE;
+  map->config.growth = 2;
+  map->config.load_factor = HASH_MAP_LOAD_FACTOR;
+  map->config.shrink_factor = 1 - HASH_MAP_LOAD_FACTOR;
+  map->config.overload_factor = HASH_MAP_OVERLOAD_FACTOR;
+  map->free_item = free_item;
+  map->hash_function = hash_function;
+  map->seed = header->seed;
+  map->verify_keys = (header->flags & SNAP_FLAG_VERIFIED) != 0;
+  map->_snap_base = base;
+  map->_snap_size = (size_t)st.st_size;
+
+  /* offset fixup, the only per-bucket work on load */
   size_t i = 0;
-  for (i = 0; i < node->capacity; i++) {
-    if (node->items[(idx + i) % node->capacity].data == NULL) {
-      return false;
+  for (i = 0; i < map->capacity; i++) {
+    HashMapBucket *node = &map->table[i];
+    map->_count += node->count;
+    if (node->capacity == 0) {
+      node->items = NULL;
+      node->ctrl = NULL;
+      continue;
     }
-    if (node->items[(idx + i) % node->capacity].data != NULL &&
-        KEY_EQU(node->items[(idx + i) % node->capacity].key, ukey)) {
-      if (data != NULL) {
-        *data = node->items[(idx + i) % node->capacity].data;
-      }
-      memset(&node->items[(idx + i) % node->capacity], 0, sizeof(*node->items));
-      node->count--;
-      if (node->count > 0) {
-        return _shrink_node_if_needed(map, ukey);
+    node->items = (HashMapBucketItem *)((char *)base + (uint64_t)node->items);
+    node->ctrl = (uint8_t *)((char *)base + (uint64_t)node->ctrl);
+    if (map->verify_keys) {
+      size_t j = 0;
+      for (j = 0; j < node->capacity; j++) {
+        if (_ctrl_live(node->ctrl[j])) {
+          node->items[j].key_str =
+              (char *)base + (uint64_t)node->items[j].key_str;
+        }
       }
-      return true;
     }
-    i++;
   }
-  return false;
+  return map;
 }
 
-void hashmap_iterate(HashMap *map, HashMapIterateItemFunction callback) {
+HashMap *hashmap_clone(HashMap *map) {
+  assert(map != NULL);
+  /* sharing cannot duplicate ownership, and modes whose read path mutates
+   * buckets or whose arrays have a foreign lifetime cannot share them
+   * across maps, see the header doc */
+  assert(map->free_item == NULL);
+  assert(!map->verify_keys);
+  assert(!map->use_arena);
+  assert(!map->read_mostly);
+  assert(!map->incremental);
+  assert(!map->expiring);
+  assert(map->_snap_base == NULL);
+  assert(map->ext_table == NULL);
+
+  HashMap *clone =
+      calloc(1, sizeof(*clone) + (sizeof(*clone->table) * map->capacity));
+  if (clone == NULL) {
+    return NULL;
+  }
+  clone->table = (HashMapBucket *)(((void *)clone) + sizeof(*clone));
+  clone->capacity = map->capacity;
+  clone->mask = map->mask;
+  clone->config = map->config;
+  clone->hash_function = map->hash_function;
+  clone->seeded_hash_function = map->seeded_hash_function;
+  clone->seed = map->seed;
+  clone->value_size = map->value_size;
+
   size_t i = 0;
   for (i = 0; i < map->capacity; i++) {
-    if (map->table[i].capacity == 0) {
+    _lock_bucket_index(map, i);
+    HashMapBucket *node = &map->table[i];
+    HashMapBucket *copy = &clone->table[i];
+    *copy = *node;
+    copy->version = 0;
+    clone->_count += node->count;
+    if (node->items == NULL) {
+      _unlock_bucket_index(map, i);
       continue;
     }
-    size_t j = 0;
-    for (j = 0; j < map->table[i].capacity; j++) {
-      if (map->table[i].items[j].data != NULL) {
-        callback((map->table[i].items[j].key), map->table[i].items[j].data);
+#if HASH_MAP_BUCKET_INLINE > 0
+    if (_bucket_inline(node)) {
+      /* inline storage travelled with the struct copy, repoint into it */
+      copy->items = copy->inline_items;
+      copy->ctrl = copy->inline_ctrl;
+      _unlock_bucket_index(map, i);
+      continue;
+    }
+#endif
+    if (node->shares == NULL) {
+      uint32_t *shares = malloc(sizeof(*shares));
+      if (shares == NULL) {
+        _unlock_bucket_index(map, i);
+        /* roll back through the regular destroy, it walks exactly the
+         * buckets cloned so far */
+        clone->capacity = i;
+        hashmap_destroy(clone);
+        return NULL;
       }
+      *shares = 2;
+      node->shares = shares;
+      copy->shares = shares;
+    } else {
+      __atomic_fetch_add(node->shares, 1, __ATOMIC_RELAXED);
     }
+    _unlock_bucket_index(map, i);
   }
+  return clone;
 }
 
-void hashmap_destroy(HashMap *map) {
-  assert(map != NULL);
+static void _destroy_buckets(HashMap *map, HashMapBucket *table,
+                             size_t capacity) {
   size_t i = 0;
-  for (i = 0; i < map->capacity; i++) {
-    if (map->table[i].items != NULL) {
-      if (map->free_item) {
+  for (i = 0; i < capacity; i++) {
+    if (table[i].items != NULL) {
+      if (map->free_item || map->verify_keys) {
         size_t j = 0;
-        for (j = 0; j < map->table[i].capacity; j++) {
-          if (map->table[i].items[j].data != NULL) {
-            map->free_item(map->table[i].items[j].data);
+        for (j = 0; j < table[i].capacity; j++) {
+          if (_ctrl_live(table[i].ctrl[j])) {
+            if (map->free_item) {
+              map->free_item(table[i].items[j].data);
+            }
+            if (map->verify_keys &&
+                !_in_snapshot(map, table[i].items[j].key_str)) {
+              free(table[i].items[j].key_str);
+            }
+          }
+        }
+      }
+      /* arena arrays are released wholesale with the chunks, snapshot ones
+       * with the mapping, shared ones by whoever drops the last reference */
+      if (table[i].shares != NULL) {
+        if (__atomic_sub_fetch(table[i].shares, 1, __ATOMIC_ACQ_REL) == 0) {
+          free(table[i].shares);
+          free(table[i].items);
+          free(table[i].ctrl);
+        }
+      } else if (!_bucket_inline(&table[i]) && !map->use_arena &&
+                 !_in_snapshot(map, table[i].items)) {
+        free(table[i].items);
+        free(table[i].ctrl);
+      }
+    }
+    if (table[i].old_items != NULL) {
+      size_t j = 0;
+      for (j = 0; j < table[i].old_capacity; j++) {
+        if (_ctrl_live(table[i].old_ctrl[j])) {
+          if (map->free_item) {
+            map->free_item(table[i].old_items[j].data);
+          }
+          if (map->verify_keys) {
+            free(table[i].old_items[j].key_str);
           }
         }
       }
-      free(map->table[i].items);
+      if (!map->use_arena) {
+        free(table[i].old_items);
+        free(table[i].old_ctrl);
+      }
+    }
+  }
+}
+
+void hashmap_destroy(HashMap *map) {
+  assert(map != NULL);
+  _destroy_buckets(map, map->table, map->capacity);
+  if (map->ext_table != NULL) {
+    _destroy_buckets(map, map->ext_table, map->ext_capacity);
+    free(map->ext_table);
+  }
+  if (map->_table_heap) {
+    free(map->table);
+  }
+  if (map->use_arena) {
+    HashMapArenaChunk *chunk = map->_arena_chunks;
+    while (chunk) {
+      HashMapArenaChunk *next = chunk->next;
+      munmap(chunk, chunk->size);
+      chunk = next;
     }
+    pthread_mutex_destroy(&map->_arena_lock);
+  }
+  if (map->_snap_base != NULL) {
+    munmap(map->_snap_base, map->_snap_size);
   }
   if (map->_tmp) {
     free(map->_tmp);
   }
-  free(map);
+  if (map->locks) {
+    size_t i = 0;
+    for (i = 0; i < map->lock_count; i++) {
+      pthread_mutex_destroy(&map->locks[i]);
+    }
+    free(map->locks);
+  }
+  if (map->read_mostly) {
+    hashmap_quiesce(map);
+    pthread_mutex_destroy(&map->_retired_lock);
+  }
+  if (map->_map_size > 0) {
+    munmap(map, map->_map_size);
+  } else {
+    free(map);
+  }
 }
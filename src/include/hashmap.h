@@ -1,6 +1,7 @@
 #ifndef HASH_MAP_H__
 #define HASH_MAP_H__
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,27 +16,214 @@ typedef struct {
 typedef struct {
   HashMapBucketKey key;
   void *data;
+  /* copy of the key bytes, only kept in verified mode */
+  char *key_str;
+  size_t key_len;
+  /* absolute expiry on the monotonic clock in milliseconds, 0 for never,
+   * only used in expiring mode, see hashmap_set_ttl */
+  uint64_t expiry;
 } HashMapBucketItem;
 
+/* Number of items stored inline inside the bucket itself. Buckets holding
+ * at most that many items need no heap array and no second cache miss on
+ * lookup; they spill to a heap array only when they outgrow it. 0 (the
+ * default) keeps the historical all-heap layout. Settable at compile time
+ * like the other tuning knobs. */
+#ifndef HASH_MAP_BUCKET_INLINE
+#define HASH_MAP_BUCKET_INLINE 0
+#endif
+
 /* A bucket */
 typedef struct {
   HashMapBucketItem *items;
+  /* one control byte per slot: 0 for empty, 1 for a tombstone left by a
+   * delete, 0x80 | 7 hash bits when occupied, so probes scan a compact
+   * array (16 bytes per SSE2 compare) instead of walking the items */
+  uint8_t *ctrl;
   size_t count;
+  /* tombstoned slots, reclaimed by rebuilds and hashmap_compact */
+  size_t tombs;
   size_t capacity;
+  /* capacity - 1; capacities are powers of two so probes index with a mask
+   * instead of an integer division */
+  size_t mask;
+  /* seqlock counter, odd while a writer mutates the bucket. Only used in
+   * read-mostly mode */
+  uint32_t version;
+  /* bumped whenever the slot layout changes (grow, shrink, reserve), so a
+   * HashMapEntry handle can tell its cached slot index went stale */
+  uint32_t generation;
+  /* reference count on the item and control arrays when they are shared
+   * with a clone, NULL while exclusively owned, see hashmap_clone. A write
+   * to a shared bucket copies the arrays first (copy-on-write). */
+  uint32_t *shares;
+  /* previous arrays while an incremental migration is in progress, drained
+   * a few slots at a time by subsequent operations on the bucket */
+  HashMapBucketItem *old_items;
+  uint8_t *old_ctrl;
+  size_t old_capacity;
+  size_t migrate_pos;
+#if HASH_MAP_BUCKET_INLINE > 0
+  /* small buckets live here, items then points into the bucket itself */
+  HashMapBucketItem inline_items[HASH_MAP_BUCKET_INLINE];
+  uint8_t inline_ctrl[HASH_MAP_BUCKET_INLINE];
+#endif
 } HashMapBucket;
 
+/**
+ * Signature for a hash function receiving the per-map seed, see the seed
+ * fields of HashMapConfig.
+ */
+typedef uint64_t (*HashMapSeededHashFunction)(const char *key, size_t len,
+                                              uint64_t seed);
+
+/* Per-map tuning, see hashmap_create_ex. The compile-time knobs
+ * (HASH_MAP_BUCKET_SIZE, HASH_MAP_LOAD_FACTOR) provide the defaults, a
+ * zero field keeps the default for that field. */
+typedef struct {
+  /* initial bucket capacity, rounded up to a power of two */
+  size_t bucket_size;
+  /* capacity multiplier on bucket growth, rounded up to a power of two,
+   * defaults to 2 */
+  size_t growth;
+  /* fraction of a bucket that may fill before it grows, in (0, 1] */
+  double load_factor;
+  /* occupancy fraction at or below which a bucket is reduced. Keeping it
+   * well under load_factor / growth gives shrink hysteresis: a bucket that
+   * just grew needs many deletes before it shrinks back, so churn at the
+   * load-factor boundary does not oscillate. Defaults to
+   * 1 - HASH_MAP_LOAD_FACTOR. */
+  double shrink_factor;
+  /* back the map block (header + primary table) with 2MB hugepages. A
+   * 16M-slot table is hundreds of MB of 4K pages otherwise and the random
+   * table[pkey & mask] access misses the TLB on nearly every lookup. Tries
+   * an explicit hugetlb mapping first (needs reserved pages, see
+   * vm.nr_hugepages), falls back to madvise(MADV_HUGEPAGE) so transparent
+   * hugepages can back it, and to regular pages where neither exists. In
+   * arena mode the chunks get the same advice. */
+  bool huge_pages;
+  /* on multi-socket hosts, bind the table to NUMA node numa_node - 1 (so 1
+   * binds node 0, keeping the zero-is-default convention), or interleave
+   * its pages across all nodes for maps shared by threads on every socket.
+   * Best effort: without kernel NUMA support the default first-touch
+   * placement stays in effect. numa_interleave wins when both are set. */
+  int numa_node;
+  bool numa_interleave;
+  /* per-map hash seed. Keys often come from untrusted input, and with a
+   * known hash an adversary can aim thousands of keys at one bucket,
+   * turning the linear probe into O(n). A secret seed makes bucket
+   * placement unpredictable. 0 keeps hashing deterministic and unseeded as
+   * before; random_seed draws a fresh seed at create and wins over an
+   * explicit one. hashmap_save stores the seed, so built-in-hash snapshots
+   * round-trip through hashmap_load. */
+  uint64_t seed;
+  bool random_seed;
+  /* user hash called with the per-map seed (e.g. XXH64's seed argument),
+   * takes precedence over the unseeded hash_function parameter. NULL uses
+   * the built-in hash, which mixes the seed in at no extra cost. Maps with
+   * a custom seeded hash cannot be revived by hashmap_load, which only
+   * accepts the unseeded signature. */
+  HashMapSeededHashFunction seeded_hash;
+  /* overload detector threshold: hashmap_stats flags buckets holding more
+   * than overload_factor times the mean items per bucket (and more than
+   * bucket_size, so small maps do not trip it) in overloaded_buckets, a
+   * cheap way to notice hash flooding or a poor hash from monitoring.
+   * Defaults to HASH_MAP_OVERLOAD_FACTOR (8). */
+  double overload_factor;
+} HashMapConfig;
+
+/* A chunk of arena memory, see hashmap_create_arena. Chunks are mmap'd,
+ * chained, and carved into bucket arrays with a bump pointer. */
+typedef struct HashMapArenaChunk {
+  struct HashMapArenaChunk *next;
+  size_t used;
+  size_t size;
+} HashMapArenaChunk;
+
+/* one recycling list per power-of-two block size, 2^47 tops */
+#define HASH_MAP_ARENA_CLASSES 48
+
 /* HashMap struct */
 typedef struct {
   HashMapBucket *table;
   size_t capacity;
+  /* capacity - 1, the capacity passed to hashmap_create is rounded up to a
+   * power of two so the primary index is a mask too */
+  size_t mask;
+
+  /* per-map tuning, filled with the compile-time defaults by
+   * hashmap_create and overridden by hashmap_create_ex */
+  HashMapConfig config;
 
   /* function */
   void (*free_item)(void *data);
   uint64_t (*hash_function)(const char *key, size_t key_len);
 
+  /* per-map hash seed and the seeded hash receiving it, both zero unless
+   * set through hashmap_create_ex, see HashMapConfig */
+  uint64_t seed;
+  uint64_t (*seeded_hash_function)(const char *key, size_t key_len,
+                                   uint64_t seed);
+
+  /* items in the map, maintained by set/delete, see hashmap_count */
+  size_t _count;
+
   /* when growing a node, we need to copy data, use that */
   HashMapBucketItem *_tmp;
   size_t _tmp_capacity;
+
+  /* striped locks, NULL when the map is not concurrent */
+  pthread_mutex_t *locks;
+  size_t lock_count;
+
+  /* verified mode: keep the key bytes and memcmp them on hash match */
+  bool verify_keys;
+
+  /* inline-value mode: values of this many bytes are copied into the data
+   * slot instead of being stored behind a pointer, 0 for pointer values */
+  size_t value_size;
+
+  /* expiring mode: probes treat items past their expiry as absent and
+   * reclaim them lazily, see hashmap_set_ttl and hashmap_evict_expired */
+  bool expiring;
+  size_t _evict_pos;
+
+  /* incremental mode: bucket growth migrates a bounded number of slots per
+   * operation instead of rehashing the whole bucket at once */
+  bool incremental;
+
+  /* read-mostly mode: readers take no lock, retired item arrays are kept
+   * until hashmap_quiesce or hashmap_destroy */
+  bool read_mostly;
+  void *_retired_head;
+  pthread_mutex_t _retired_lock;
+
+  /* arena mode: bucket arrays are carved from mmap'd chunks and recycled
+   * through per-size-class free lists instead of going through malloc */
+  bool use_arena;
+  HashMapArenaChunk *_arena_chunks;
+  void *_arena_free[HASH_MAP_ARENA_CLASSES];
+  pthread_mutex_t _arena_lock;
+
+  /* gradual primary-table extension, see hashmap_extend: a larger second
+   * table the old buckets drain into, a few per operation. ext_table is
+   * NULL when no extension is running; buckets below ext_pos have moved. */
+  HashMapBucket *ext_table;
+  size_t ext_capacity;
+  size_t ext_mask;
+  size_t ext_pos;
+  /* set once an extension completed: table then is its own heap block, not
+   * the tail of the map allocation, and must be freed on destroy */
+  bool _table_heap;
+
+  /* set when the map was built by hashmap_load: the table and the bucket
+   * arrays live in this mapping and are released with munmap, not free */
+  void *_snap_base;
+  size_t _snap_size;
+
+  /* nonzero when the map block itself is mmap'd (hugepage or NUMA-placed
+   * tables, see HashMapConfig) and must be munmap'd, not free'd */
+  size_t _map_size;
 } HashMap;
 
 /**
@@ -53,12 +241,18 @@ typedef void (*HashMapFreeItemFunction)(void *data);
  */
 typedef void (*HashMapIterateItemFunction)(HashMapBucketKey key, void *data);
 
+/**
+ * Signature for the hashmap_upsert compute callback
+ */
+typedef void *(*HashMapComputeFunction)(void *old, void *ctx);
+
 /**
  * Create a new hash map.
  *
- * @param capacity Main index size. It is allocated once and never modified.
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
  * @param hash_function Hash function to use, the function must return a
- * uint64_t
+ * uint64_t. Pass NULL to use the built-in hash.
  * @param free_item If data stored in table must be freed, pass a function. If
  * not, just pass NULL.
  *
@@ -66,6 +260,219 @@ typedef void (*HashMapIterateItemFunction)(HashMapBucketKey key, void *data);
  */
 HashMap *hashmap_create(size_t capacity, HashMapHashFunction hash_function,
                         HashMapFreeItemFunction free_item);
+
+/**
+ * Create a new hash map with per-map tuning.
+ *
+ * The compile-time knobs set one tuning for every map in the process, but a
+ * huge read-heavy map (high load factor for memory) and a small churny one
+ * (low load factor for probe speed) want opposite settings. Fields left at
+ * zero keep the compile-time defaults, out-of-range values fall back to
+ * them too.
+ *
+ * The config also carries allocation placement (huge_pages, numa_node,
+ * numa_interleave): with any of those set the map block is mmap'd instead of
+ * calloc'd so the primary table can sit on hugepages and be placed on a
+ * chosen NUMA node. See the HashMapConfig fields for details.
+ *
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
+ * @param config Tuning to apply, or NULL to keep all defaults.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_ex(size_t capacity, const HashMapConfig *config,
+                           HashMapHashFunction hash_function,
+                           HashMapFreeItemFunction free_item);
+
+/**
+ * Create a new hash map safe for use from several threads.
+ *
+ * Buckets are grouped in stripes, each stripe protected by its own mutex, so
+ * operations on keys landing in different stripes run in parallel. A bucket
+ * grow or shrink only pauses its own stripe, never the whole map.
+ *
+ * @param capacity Main index size. It is allocated once and never modified.
+ * @param stripes Number of lock stripes. Pass 0 to get a sane default. The
+ * value is capped to capacity.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_concurrent(size_t capacity, size_t stripes,
+                                   HashMapHashFunction hash_function,
+                                   HashMapFreeItemFunction free_item);
+
+/**
+ * Create a concurrent hash map optimized for read-mostly workloads.
+ *
+ * Like hashmap_create_concurrent, but hashmap_get takes no lock at all:
+ * readers validate against a per-bucket version counter and retry if a
+ * writer touched the bucket mid-probe. Writers still serialize per stripe.
+ *
+ * Bucket item arrays replaced during grow/shrink are not freed immediately,
+ * they are retired and reclaimed by hashmap_quiesce (RCU style, the caller
+ * provides the grace period) or by hashmap_destroy. Note that the data
+ * pointer returned by a lock-free hashmap_get can be freed by a concurrent
+ * delete at any time, value lifetime is the caller's responsibility.
+ *
+ * @param capacity Main index size. It is allocated once and never modified.
+ * @param stripes Number of lock stripes for the write side. Pass 0 to get a
+ * sane default.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_read_mostly(size_t capacity, size_t stripes,
+                                    HashMapHashFunction hash_function,
+                                    HashMapFreeItemFunction free_item);
+
+/**
+ * Create a hash map that keeps a copy of each key and verifies it on lookup.
+ *
+ * The regular mode trusts the 64-bit hash entirely, so two distinct keys
+ * colliding on the full 64 bits silently alias each other — unlikely, but
+ * real at billions of keys over a map's lifetime. In verified mode the fast
+ * 64-bit compare stays as a filter and a memcmp of the stored key bytes
+ * confirms the match, at the cost of one pointer + length per item.
+ *
+ * The _hashed variants cannot verify anything: get/delete fall back to the
+ * hash-only compare, and hashmap_set_hashed must not be used on a verified
+ * map (it has no key bytes to store).
+ *
+ * @param capacity Main index size. It is allocated once and never modified.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_verified(size_t capacity,
+                                 HashMapHashFunction hash_function,
+                                 HashMapFreeItemFunction free_item);
+
+/**
+ * Create a hash map whose bucket growth is spread over many operations.
+ *
+ * A regular bucket grow rehashes every item before the triggering set
+ * returns, which on a large skewed bucket is a visible pause. Here the
+ * bucket keeps its previous arrays aside and every subsequent
+ * set/get/delete touching the bucket migrates a bounded number of slots
+ * (HASH_MAP_MIGRATE_STEP, settable at compile time), so no single
+ * operation ever pays a full rehash. Note that get may therefore modify
+ * the map; this mode is meant for single-threaded latency-sensitive use
+ * and must not be combined with the concurrent creators.
+ *
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_incremental(size_t capacity,
+                                    HashMapHashFunction hash_function,
+                                    HashMapFreeItemFunction free_item);
+
+/**
+ * Create a hash map that allocates bucket arrays from its own arena.
+ *
+ * Every bucket grow and shrink normally goes through calloc/realloc/free, so
+ * a large map performs hundreds of thousands of small allocations that
+ * fragment the heap and contend on the allocator lock under threads. Here
+ * the arrays are carved from large mmap'd chunks (HASH_MAP_ARENA_CHUNK_SIZE,
+ * settable at compile time) and recycled through per-size-class free lists,
+ * and hashmap_destroy releases them with a handful of munmap calls instead
+ * of a per-bucket free loop. Not combinable with hashmap_create_read_mostly
+ * (retired arrays are reclaimed with free).
+ *
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
+ * @param stripes Number of lock stripes. Pass 0 for a single-threaded map,
+ * any other value makes the map behave like hashmap_create_concurrent.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_arena(size_t capacity, size_t stripes,
+                              HashMapHashFunction hash_function,
+                              HashMapFreeItemFunction free_item);
+
+/**
+ * Create a hash map that stores small values inline, by value.
+ *
+ * Storing an 8-byte counter behind a void* costs a heap allocation per
+ * entry and an extra pointer chase on every get. Here values of up to
+ * sizeof(void*) bytes are copied straight into the data slot of the item,
+ * so there is no per-entry allocation, no free_item bookkeeping and one
+ * cache miss less on the read path. Use hashmap_set_inline and
+ * hashmap_get_inline on such a map; the pointer accessors would hand back
+ * the raw value bits.
+ *
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param value_size Size of the stored values in bytes, between 1 and
+ * sizeof(void*). All values of the map have this size.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_inline(size_t capacity,
+                               HashMapHashFunction hash_function,
+                               size_t value_size);
+
+/**
+ * Create a hash map whose items can carry a time-to-live.
+ *
+ * A cache swept with a periodic full iterate pays a stop-the-world scan of
+ * the whole table to evict a few expired items. Here expiry is lazy:
+ * probes treat an item past its deadline as absent and reclaim its slot in
+ * passing (calling free_item), so eviction cost lands only on the buckets
+ * that are actually touched. hashmap_evict_expired adds an incremental
+ * background sweep for buckets no request visits. Expiry is tracked on the
+ * monotonic clock of the process; note that get may therefore modify the
+ * map, like in incremental mode.
+ *
+ * @param capacity Main index size, rounded up to the next power of two. It is
+ * allocated once and never modified.
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return a new hash map or NULL in case of an error.
+ */
+HashMap *hashmap_create_expiring(size_t capacity,
+                                 HashMapHashFunction hash_function,
+                                 HashMapFreeItemFunction free_item);
+
+/**
+ * Reclaim item arrays retired by grow/shrink in a read-mostly map.
+ *
+ * Call this when no reader can still hold a pointer into the map (e.g. at
+ * the end of an event-loop tick). Does nothing on other map kinds.
+ *
+ * @param map The hash map object
+ */
+void hashmap_quiesce(HashMap *map);
+
 /**
  * Get an item by key. The item must not be freed, it stay in the map untouched.
  *
@@ -76,6 +483,198 @@ HashMap *hashmap_create(size_t capacity, HashMapHashFunction hash_function,
  */
 void *hashmap_get(HashMap *map, const char *key);
 
+/**
+ * Same as hashmap_get but with an explicit key length.
+ *
+ * The string functions strlen their key on every call even though most
+ * callers already know the length, and NUL-terminated keys rule out binary
+ * keys (fixed-size UUIDs, ...). The _n variants take (key, len) instead;
+ * the key bytes can be anything.
+ *
+ * @param map The hash map object
+ * @param key The key
+ * @param len Length of the key, must be > 0
+ *
+ * @return The item data or NULL if not found.
+ */
+void *hashmap_get_n(HashMap *map, const char *key, size_t len);
+
+/**
+ * Same as hashmap_set but with an explicit key length, see hashmap_get_n.
+ *
+ * @param map The hash map object.
+ * @param key The key where to add.
+ * @param len Length of the key, must be > 0
+ * @param data The data you want to associate with the key.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_set_n(HashMap *map, const char *key, size_t len, void *data);
+
+/**
+ * Same as hashmap_delete but with an explicit key length, see hashmap_get_n.
+ *
+ * @param map The hash map object.
+ * @param key The key
+ * @param len Length of the key, must be > 0
+ * @param[out] A point to a void * where the data associated with the key is
+ * set.
+ *
+ * @return True if the value is found and deleted, false owtherwise.
+ */
+bool hashmap_delete_n(HashMap *map, const char *key, size_t len, void **data);
+
+/**
+ * Get a value from an inline-value map, copying it out by value.
+ *
+ * Only valid on maps built by hashmap_create_inline; the value_size bytes
+ * of the stored value are copied into value. A boolean result is needed
+ * here because an all-zero value is a perfectly valid inline value and
+ * cannot double as the not-found marker.
+ *
+ * @param map The hash map object, built by hashmap_create_inline
+ * @param key The key
+ * @param[out] value Where the value bytes are copied on a hit, may be NULL
+ * to only test for presence.
+ *
+ * @return True if the key was found, false owtherwise.
+ */
+bool hashmap_get_inline(HashMap *map, const char *key, void *value);
+
+/**
+ * Insert or update a value in an inline-value map, copying it by value.
+ *
+ * The value_size bytes at value are copied into the data slot of the item:
+ * no allocation, nothing for the caller to keep alive afterwards.
+ *
+ * @param map The hash map object, built by hashmap_create_inline
+ * @param key The key where to add.
+ * @param value The value bytes to copy in.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_set_inline(HashMap *map, const char *key, const void *value);
+
+/**
+ * Atomically read-modify-write the value of a key in one probe.
+ *
+ * The usual get-then-set hashes the key twice and probes the bucket twice.
+ * Here the slot is located once, compute is called with the current value
+ * (NULL when the key is absent) and its result is stored in place, all
+ * under the bucket lock on a concurrent map, so the update is atomic with
+ * respect to other writers of the same stripe.
+ *
+ * The callback owns the value transition: free_item is NOT called on the
+ * old value, reuse or free it in compute. On a pointer map compute must
+ * return the value to store and it must not be NULL. On an inline-value
+ * map the value bits themselves are passed and returned in the pointer (an
+ * absent key passes NULL, indistinguishable from an all-zero value, which
+ * is exactly what a fresh counter wants).
+ *
+ * @param map The hash map object.
+ * @param key The key where to add or update.
+ * @param compute Called with the current value and ctx, returns the value
+ * to store.
+ * @param ctx Opaque context handed to compute.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_upsert(HashMap *map, const char *key,
+                    HashMapComputeFunction compute, void *ctx);
+
+/**
+ * Insert or update a key with a time-to-live, see hashmap_create_expiring.
+ *
+ * The item vanishes from lookups ttl_ms milliseconds from now and its slot
+ * is reclaimed by whichever probe or eviction sweep touches it first. A
+ * plain hashmap_set on the same key stores a non-expiring value again.
+ *
+ * @param map The hash map object, built by hashmap_create_expiring
+ * @param key The key where to add.
+ * @param data The data you want to associate with the key.
+ * @param ttl_ms Lifetime in milliseconds, 0 for no expiry.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_set_ttl(HashMap *map, const char *key, void *data,
+                     uint64_t ttl_ms);
+
+/**
+ * Run a bounded slice of background eviction on an expiring map.
+ *
+ * Lazy expiry only reclaims slots the probes happen to touch; items in
+ * cold buckets would otherwise linger. Each call scans up to max_buckets
+ * buckets starting where the previous call stopped, reclaiming every
+ * expired item it finds, so the whole table is covered incrementally
+ * across calls instead of in one pause.
+ *
+ * @param map The hash map object
+ * @param max_buckets Bucket budget for this slice, 0 for the whole table.
+ *
+ * @return the number of items evicted by this slice.
+ */
+size_t hashmap_evict_expired(HashMap *map, size_t max_buckets);
+
+/**
+ * Hash a key once so it can be reused across several operations (or several
+ * maps sharing the same hash function) without rehashing the string.
+ *
+ * @param map The hash map object
+ * @param key The key
+ * @param len Length of the key, must be > 0
+ *
+ * @return The computed key, to pass to the _hashed variants.
+ */
+HashMapBucketKey hashmap_hash(HashMap *map, const char *key, size_t len);
+
+/**
+ * Same as hashmap_get but with a key precomputed by hashmap_hash.
+ *
+ * @param map The hash map object
+ * @param key The precomputed key
+ *
+ * @return The item data or NULL if not found.
+ */
+void *hashmap_get_hashed(HashMap *map, HashMapBucketKey key);
+
+/**
+ * Same as hashmap_set but with a key precomputed by hashmap_hash.
+ *
+ * @param map The hash map object.
+ * @param key The precomputed key.
+ * @param data The data you want to associate with the key.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_set_hashed(HashMap *map, HashMapBucketKey key, void *data);
+
+/**
+ * Same as hashmap_delete but with a key precomputed by hashmap_hash.
+ *
+ * @param map The hash map object.
+ * @param key The precomputed key
+ * @param[out] A point to a void * where the data associated with the key is
+ * set.
+ *
+ * @return True if the value is found and deleted, false owtherwise.
+ */
+bool hashmap_delete_hashed(HashMap *map, HashMapBucketKey key, void **data);
+
+/**
+ * Look up several keys at once.
+ *
+ * Keys are hashed first, then the primary buckets and the item arrays are
+ * prefetched ahead of the probes, so the memory latency of independent
+ * lookups overlaps instead of being paid serially. Use this for join-like
+ * workloads probing tens to hundreds of keys at a time.
+ *
+ * @param map The hash map object
+ * @param keys The keys to look up
+ * @param n Number of keys
+ * @param[out] out Receives the data for each key, NULL where not found.
+ */
+void hashmap_get_batch(HashMap *map, const char **keys, size_t n, void **out);
+
 /**
  * Add an item in the hash map. If the item could not be added, it is not freed.
  *
@@ -87,6 +686,57 @@ void *hashmap_get(HashMap *map, const char *key);
  */
 bool hashmap_set(HashMap *map, const char *key, void *data);
 
+/**
+ * Insert many items at once, pre-sizing every touched bucket in one pass.
+ *
+ * Inserting N keys one by one walks each bucket through the whole doubling
+ * ladder, so a bucket ending at 64 slots is rehashed at 8, 16 and 32 first
+ * and every item is copied several times. Here all keys are hashed up
+ * front, per-bucket occupancy is counted, each bucket is grown to its
+ * final capacity with a single allocation and rehash, then the items are
+ * inserted. Use this for cold-start bulk loads.
+ *
+ * Duplicate keys in the batch behave like repeated hashmap_set calls: the
+ * last value wins.
+ *
+ * @param map The hash map object.
+ * @param keys The keys to insert.
+ * @param values The data to associate with each key.
+ * @param n Number of keys.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_set_bulk(HashMap *map, const char **keys, void **values,
+                      size_t n);
+
+/**
+ * Insert a stream of items through a staged pipeline.
+ *
+ * The write-side sibling of hashmap_get_batch, built for steady ingest
+ * rather than cold-start loads: keys are hashed in a window (with the
+ * primary buckets prefetched), the window is grouped by bucket, then each
+ * bucket is locked once, grown at most once for all its keys and its
+ * probe starts prefetched before the stores. Compared to a loop over
+ * hashmap_set this overlaps the dependent memory accesses and, on a
+ * lock-striped map, takes one lock per touched bucket per window instead
+ * of one per key.
+ *
+ * Unlike hashmap_set_bulk this allocates nothing and takes explicit key
+ * lengths, so wire-format keys need no copy or scan. Duplicate keys in
+ * the batch behave like repeated hashmap_set calls: the last value wins.
+ *
+ * @param map The hash map object.
+ * @param keys The keys to insert.
+ * @param lens Length of each key, or NULL to use strlen.
+ * @param values The data to associate with each key.
+ * @param n Number of keys.
+ *
+ * @return True in case of success; false on allocation failure, with a
+ * prefix of the batch inserted.
+ */
+bool hashmap_set_batch(HashMap *map, const char **keys, const size_t *lens,
+                       void **values, size_t n);
+
 /**
  * Remove an item from the hash map. The item is not freed, if you need to free
  * it, pass a pointer to get the value back.
@@ -109,6 +759,309 @@ bool hashmap_delete(HashMap *map, const char *key, void **data);
  */
 void hashmap_iterate(HashMap *map, HashMapIterateItemFunction callback);
 
+/* bucket-occupancy histogram bins, the last bin collects everything at or
+ * above HASH_MAP_STATS_BINS items */
+#define HASH_MAP_STATS_BINS 16
+
+/* Map health report, see hashmap_stats */
+typedef struct {
+  size_t count;         /* items in the map */
+  size_t buckets;       /* primary slots */
+  size_t empty_buckets; /* primary slots holding no item */
+  double empty_ratio;   /* empty_buckets / buckets */
+  /* bytes allocated for item and control arrays, old migration arrays
+   * included, inline storage excluded */
+  size_t allocated_bytes;
+  /* bytes of allocated_bytes a hashmap_shrink_to_fit call would return:
+   * bucket arrays sized beyond the smallest power of two holding their
+   * live items. Trigger a shrink when this crosses your threshold. */
+  size_t slack_bytes;
+  size_t max_bucket_count;  /* items in the fullest bucket */
+  size_t max_probe_length;  /* longest probe chain, in slots */
+  double mean_probe_length; /* average probe chain, in slots */
+  /* occupancy_histogram[i]: buckets holding exactly i items, the last bin
+   * holds every bucket at or above HASH_MAP_STATS_BINS */
+  size_t occupancy_histogram[HASH_MAP_STATS_BINS + 1];
+  /* buckets holding more than overload_factor times the mean, see
+   * HashMapConfig. Nonzero under a healthy hash means skewed input, under
+   * untrusted input it is the collision-flooding alarm. */
+  size_t overloaded_buckets;
+} HashMapStats;
+
+/**
+ * Number of items in the map.
+ *
+ * Maintained incrementally by set and delete, so this is a plain read, not
+ * a sweep.
+ *
+ * @param map The hash map object
+ *
+ * @return the number of items currently stored.
+ */
+size_t hashmap_count(HashMap *map);
+
+/**
+ * Aggregate occupancy and probe-length statistics over the whole map.
+ *
+ * Tells hash skew (occupancy histogram, max bucket), probing health (max
+ * and mean probe length) and memory footprint apart without a debugger.
+ * The sweep walks every bucket, so scrape it on demand, not per
+ * operation; the hot paths only maintain the item count.
+ *
+ * @param map The hash map object
+ * @param[out] stats Filled with the aggregated numbers.
+ */
+void hashmap_stats(HashMap *map, HashMapStats *stats);
+
+/**
+ * Reclaim tombstoned slots left behind by deletes.
+ *
+ * A delete only marks its slot (O(1)) and probes walk through the mark, so
+ * delete latency is flat but heavily churned buckets accumulate dead slots
+ * that lengthen probes. This pass rewrites only the buckets whose
+ * tombstone ratio exceeds 1/HASH_MAP_TOMB_RATIO (settable at compile time,
+ * defaults to 4), so it can be scheduled off-peak. Inserts also reuse
+ * tombstones and a bucket full of them is rebuilt in place instead of
+ * grown, so calling this is an optimization, never a correctness need.
+ *
+ * @param map The hash map object
+ *
+ * @return the number of buckets that were rewritten.
+ */
+size_t hashmap_compact(HashMap *map);
+
+/**
+ * Start growing the primary table online, without a rehash pause.
+ *
+ * The fixed primary capacity keeps operations pause-free, but a map that
+ * outgrows the capacity guessed at create time ends up with every bucket
+ * carrying many times the intended items and probe lengths to match. This
+ * allocates a second, larger primary table and has every subsequent set,
+ * get and delete move a bounded number of buckets
+ * (HASH_MAP_EXTEND_STEP, default 1) from the old table into it, so the
+ * extension finishes after ~capacity operations with strictly bounded
+ * per-operation overhead. Lookups route through whichever table currently
+ * owns their bucket; iteration, stats, compaction and expiry sweeps cover
+ * both tables while the migration runs, and hashmap_save completes it
+ * first.
+ *
+ * Only single-threaded maps can extend (no striped locks, not read-mostly):
+ * a key's stripe would change tables mid-migration. The old table's memory
+ * stays attached to the map allocation until destroy; the new table is a
+ * regular heap block (hugepage placement applies to the create-time table
+ * only).
+ *
+ * @param map The hash map object
+ * @param capacity New primary capacity, rounded up to the next power of
+ * two. Must exceed the current capacity.
+ *
+ * @return True when the extension started (or capacity was already
+ * reached), false while another extension is still running or on
+ * allocation failure.
+ */
+bool hashmap_extend(HashMap *map, size_t capacity);
+
+/**
+ * Trim every bucket's arrays down to its current item count.
+ *
+ * Deletes shrink a bucket one growth step at a time, and only when a
+ * further delete happens to land in it, so a map purged of most of its
+ * items keeps bucket arrays at their high-water capacities indefinitely.
+ * This pass walks the table once and reallocates each bucket to the
+ * smallest power of two holding its live items (never below the
+ * configured bucket_size), returning the slack to the allocator.
+ * slack_bytes in HashMapStats reports how much a call would reclaim.
+ *
+ * Buckets with a pending incremental migration are left alone; run the
+ * map until migrations drain and call again. Inserting after a shrink
+ * regrows buckets normally, so reserve capacity first if refill is
+ * imminent.
+ *
+ * @param map The hash map object
+ *
+ * @return the number of bytes returned to the allocator. Buckets whose
+ * replacement arrays cannot be allocated keep their current capacity.
+ */
+size_t hashmap_shrink_to_fit(HashMap *map);
+
+/* Handle onto a located entry, see hashmap_find. Plain values, no
+ * allocation. A handle caches the slot index of the key together with the
+ * bucket generation; while the layout is unchanged, repeated accesses skip
+ * the probe entirely, a stale handle silently re-probes and refreshes. */
+typedef struct {
+  HashMap *map;
+  /* the caller's key, it must stay valid for the life of the handle */
+  const char *key_str;
+  size_t key_len;
+  HashMapBucketKey key;
+  size_t slot; /* cached slot in the bucket, SIZE_MAX when not located */
+  uint32_t generation;
+} HashMapEntry;
+
+/**
+ * Locate a key once and hand back a reusable handle onto its slot.
+ *
+ * Updating the same key several times within a request pays one hash and
+ * one probe per access through the regular API. A handle amortizes that:
+ * the first access probes, subsequent hashmap_entry_value and
+ * hashmap_entry_set calls hit the cached slot directly as long as the
+ * bucket layout (its generation) is unchanged. The key pointer is kept in
+ * the handle and must outlive it.
+ *
+ * @param map The hash map object
+ * @param key The key
+ *
+ * @return a handle, usable whether or not the key currently exists.
+ */
+HashMapEntry hashmap_find(HashMap *map, const char *key);
+
+/**
+ * Read the value behind a handle.
+ *
+ * @param entry The handle
+ *
+ * @return The item data, or NULL when the key is not in the map.
+ */
+void *hashmap_entry_value(HashMapEntry *entry);
+
+/**
+ * Write the value behind a handle, inserting the key if it vanished.
+ *
+ * Behaves like hashmap_set on the handle's key (free_item is called on a
+ * replaced value) without rehashing it, and without re-probing when the
+ * cached slot is still current.
+ *
+ * @param entry The handle
+ * @param data The data you want to associate with the key.
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_entry_set(HashMapEntry *entry, void *data);
+
+/* Cursor over a map, see hashmap_iter. Plain values, no allocation: copy
+ * and store it freely between slices. */
+typedef struct {
+  HashMap *map;
+  size_t bucket; /* next primary slot to visit */
+  size_t slot;   /* next slot within that bucket */
+} HashMapIter;
+
+/**
+ * Start a cursor-based traversal of the map.
+ *
+ * hashmap_iterate walks the whole map in one synchronous sweep, which on a
+ * large map is a long pause. A cursor visits items in primary-table order
+ * and can be suspended and resumed across event-loop ticks: grow or shrink
+ * of buckets the cursor has not reached yet does not invalidate it.
+ * Mutating the bucket it currently points into may skip or repeat items of
+ * that one bucket.
+ *
+ * @param map The hash map object
+ *
+ * @return a cursor positioned before the first item.
+ */
+HashMapIter hashmap_iter(HashMap *map);
+
+/**
+ * Advance the cursor to the next item.
+ *
+ * @param it The cursor
+ * @param[out] key Receives the item key, may be NULL.
+ * @param[out] data Receives the item data, may be NULL.
+ *
+ * @return True if an item was produced, false when the traversal is done.
+ */
+bool hashmap_iter_next(HashMapIter *it, HashMapBucketKey *key, void **data);
+
+/**
+ * Run a bounded slice of a traversal.
+ *
+ * Calls the callback on at most max_items items and leaves the cursor
+ * where it stopped, turning a full-map scan into incremental slices of a
+ * chosen size.
+ *
+ * @param it The cursor
+ * @param callback The function to call on each item
+ * @param max_items Budget for this slice
+ *
+ * @return the number of items visited, less than max_items only when the
+ * traversal is done.
+ */
+size_t hashmap_iterate_bounded(HashMapIter *it,
+                               HashMapIterateItemFunction callback,
+                               size_t max_items);
+
+/**
+ * Write a snapshot of the map to a file descriptor.
+ *
+ * The on-disk layout mirrors the in-memory one: a header, the primary table
+ * of bucket descriptors with file offsets instead of pointers, then the item
+ * and control arrays (and the key bytes in verified mode). hashmap_load
+ * rebuilds the map from it with a single mmap and an offset fixup pass, no
+ * rehashing and no per-key insertion.
+ *
+ * The data pointers are stored verbatim, so the format only round-trips
+ * values that are meaningful across processes (integers, indexes or offsets
+ * cast to void *, ...), not heap pointers. The map must be quiescent for the
+ * duration of the call.
+ *
+ * @param map The hash map object
+ * @param fd File descriptor open for writing
+ *
+ * @return True in case of success, false owtherwise.
+ */
+bool hashmap_save(HashMap *map, int fd);
+
+/**
+ * Rebuild a map from a snapshot written by hashmap_save.
+ *
+ * The file is mmap'd copy-on-write and the bucket arrays are used in place,
+ * so loading costs one mmap plus a pointer fixup per bucket however many
+ * items the map holds. The snapshot stores the computed hashes, so the hash
+ * function is never called on load; pass the same one that built the saved
+ * map, it is needed for subsequent operations. A bucket that grows later
+ * moves to a heap array transparently, the mapping is released by
+ * hashmap_destroy.
+ *
+ * The snapshot format depends on the compile-time layout knobs
+ * (HASH_MAP_BUCKET_INLINE, ...): a file written by a differently configured
+ * build is rejected.
+ *
+ * @param fd File descriptor open for reading
+ * @param hash_function Hash function to use, the function must return a
+ * uint64_t. Pass NULL to use the built-in hash.
+ * @param free_item If data stored in table must be freed, pass a function. If
+ * not, just pass NULL.
+ *
+ * @return the loaded hash map or NULL in case of an error.
+ */
+HashMap *hashmap_load(int fd, HashMapHashFunction hash_function,
+                      HashMapFreeItemFunction free_item);
+
+/**
+ * In-memory copy-on-write clone of the map.
+ *
+ * The clone gets its own primary table but shares the bucket arrays with
+ * the parent, so cloning costs O(primary capacity), not O(items), and no
+ * rehashing. The first write to a shared bucket — on either map — copies
+ * just that bucket's arrays, so updating the live map after handing a clone
+ * to readers costs O(changed buckets) instead of a full rebuild. Readers
+ * of the clone see the exact bucket contents of clone time.
+ *
+ * Sharing cannot duplicate ownership, so the parent must store caller-owned
+ * values (no free_item) and must not be in a mode whose read path mutates
+ * buckets or whose arrays have a foreign lifetime: verified keys, arena,
+ * read-mostly, incremental, expiring and snapshot-loaded maps cannot be
+ * cloned (asserted). On a concurrent parent each bucket is copied under its
+ * lock, so every bucket is internally consistent; the clone itself has no
+ * locks and is meant to be read, or written from a single thread.
+ *
+ * @param map The hash map object
+ *
+ * @return the clone or NULL in case of an error.
+ */
+HashMap *hashmap_clone(HashMap *map);
+
 /**
  * Destroy the hashmap, free everything including the data stored in it.
  *
@@ -0,0 +1,1291 @@
+/**
+ * api-test.c
+ *
+ * Functional checks for the extended API (precomputed hashes, batched
+ * lookups, ...) that the other test programs do not cover.
+ *
+ * To compile and run (assuming you are in the root of the project):
+ * gcc -o test/api-test test/api-test.c src/hashmap.c
+ * ./test/api-test
+ */
+#include "../src/include/hashmap.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_ASSERT(condition, message)                                        \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Assertion failed: (%s), in %s, line %d: %s\n",          \
+              #condition, __FILE__, __LINE__, message);                        \
+      exit(EXIT_FAILURE);                                                      \
+    }                                                                          \
+  } while (0)
+
+static uint64_t fnv1a(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void test_hashed_variants(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(64, fnv1a, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  HashMapBucketKey key = hashmap_hash(map, "cached_key", strlen("cached_key"));
+  TEST_ASSERT(hashmap_set_hashed(map, key, "value"),
+              "hashmap_set_hashed should succeed.");
+  TEST_ASSERT(strcmp(hashmap_get_hashed(map, key), "value") == 0,
+              "hashmap_get_hashed should return the stored value.");
+  TEST_ASSERT(strcmp(hashmap_get(map, "cached_key"), "value") == 0,
+              "string get should agree with the hashed path.");
+
+  void *data = NULL;
+  TEST_ASSERT(hashmap_delete_hashed(map, key, &data),
+              "hashmap_delete_hashed should find the key.");
+  TEST_ASSERT(strcmp(data, "value") == 0,
+              "deleted data should be handed back.");
+  TEST_ASSERT(hashmap_get_hashed(map, key) == NULL,
+              "key should be gone after hashed delete.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_get_batch(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(97, fnv1a, free);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 300 };
+  char keybuf[NKEYS][24];
+  const char *keys[NKEYS];
+  void *out[NKEYS];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(keybuf[i], sizeof(keybuf[i]), "batch_key_%d", i);
+    keys[i] = keybuf[i];
+    /* only insert two keys out of three, the rest must come back NULL */
+    if (i % 3 != 2) {
+      TEST_ASSERT(hashmap_set(map, keybuf[i], strdup(keybuf[i])),
+                  "hashmap_set should succeed.");
+    }
+  }
+
+  hashmap_get_batch(map, keys, NKEYS, out);
+  for (i = 0; i < NKEYS; i++) {
+    if (i % 3 != 2) {
+      TEST_ASSERT(out[i] != NULL && strcmp(out[i], keybuf[i]) == 0,
+                  "batched lookup should find inserted keys.");
+    } else {
+      TEST_ASSERT(out[i] == NULL,
+                  "batched lookup should report missing keys as NULL.");
+    }
+  }
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+/* worst possible hash: every key collides on all 64 bits */
+static uint64_t constant_hash(const char *key, size_t len) {
+  (void)key;
+  (void)len;
+  return 0x0123456789abcdefULL;
+}
+
+static void test_verified_keys(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create_verified(16, constant_hash, free);
+  TEST_ASSERT(map != NULL, "hashmap_create_verified should not return NULL.");
+
+  /* with a hash-only compare these keys would all alias each other */
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 12; i++) {
+    snprintf(key, sizeof(key), "verified_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, strdup(key)),
+                "set should succeed despite full-hash collisions.");
+  }
+  for (i = 0; i < 12; i++) {
+    snprintf(key, sizeof(key), "verified_key_%d", i);
+    char *val = hashmap_get(map, key);
+    TEST_ASSERT(val != NULL && strcmp(val, key) == 0,
+                "verified map must keep colliding keys distinct.");
+  }
+
+  /* overwrite must hit the exact key, not a colliding one */
+  TEST_ASSERT(hashmap_set(map, "verified_key_3", strdup("updated")),
+              "overwrite should succeed.");
+  TEST_ASSERT(strcmp(hashmap_get(map, "verified_key_3"), "updated") == 0,
+              "overwrite should update the right key.");
+  TEST_ASSERT(strcmp(hashmap_get(map, "verified_key_4"), "verified_key_4") ==
+                  0,
+              "overwrite must not touch a colliding neighbour.");
+
+  void *data = NULL;
+  TEST_ASSERT(hashmap_delete(map, "verified_key_7", &data),
+              "delete should find the exact key.");
+  free(data);
+  TEST_ASSERT(hashmap_get(map, "verified_key_7") == NULL,
+              "deleted key should be gone.");
+  TEST_ASSERT(hashmap_get(map, "verified_key_8") != NULL,
+              "delete must not take out a colliding neighbour.");
+
+  /* batched lookups must run the same memcmp filter as hashmap_get: a
+   * colliding absent key may not alias a present one */
+  const char *batch_keys[3] = {"verified_key_4", "verified_absent",
+                               "verified_key_8"};
+  void *batch_out[3] = {NULL, NULL, NULL};
+  hashmap_get_batch(map, batch_keys, 3, batch_out);
+  TEST_ASSERT(batch_out[0] != NULL &&
+                  strcmp(batch_out[0], "verified_key_4") == 0,
+              "batched lookup must find the exact key.");
+  TEST_ASSERT(batch_out[1] == NULL,
+              "batched lookup must not alias a colliding absent key.");
+  TEST_ASSERT(batch_out[2] != NULL &&
+                  strcmp(batch_out[2], "verified_key_8") == 0,
+              "batched lookup must verify every key in the window.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_incremental(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* tiny primary table so buckets go through several doublings, each one
+   * leaving a migration in progress */
+  HashMap *map = hashmap_create_incremental(4, fnv1a, free);
+  TEST_ASSERT(map != NULL, "hashmap_create_incremental should not return NULL.");
+
+  enum { NKEYS = 2000 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "incr_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, strdup(key)),
+                "hashmap_set should succeed.");
+    /* reread an older key while its bucket may be mid-migration */
+    if (i > 0) {
+      snprintf(key, sizeof(key), "incr_key_%d", i / 2);
+      char *val = hashmap_get(map, key);
+      TEST_ASSERT(val != NULL && strcmp(val, key) == 0,
+                  "get must find keys still parked in the old arrays.");
+    }
+  }
+  /* delete a third of the keys, some straight out of old arrays */
+  for (i = 0; i < NKEYS; i += 3) {
+    snprintf(key, sizeof(key), "incr_key_%d", i);
+    void *data = NULL;
+    TEST_ASSERT(hashmap_delete(map, key, &data),
+                "delete should find every inserted key.");
+    free(data);
+  }
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "incr_key_%d", i);
+    char *val = hashmap_get(map, key);
+    if (i % 3 == 0) {
+      TEST_ASSERT(val == NULL, "deleted keys must stay gone.");
+    } else {
+      TEST_ASSERT(val != NULL && strcmp(val, key) == 0,
+                  "remaining keys must survive the migrations.");
+    }
+  }
+  /* overwrite keys that may still sit in old arrays: no duplicates allowed */
+  for (i = 1; i < NKEYS; i += 3) {
+    snprintf(key, sizeof(key), "incr_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, strdup("rewritten")),
+                "overwrite should succeed.");
+  }
+  for (i = 1; i < NKEYS; i += 3) {
+    snprintf(key, sizeof(key), "incr_key_%d", i);
+    char *val = hashmap_get(map, key);
+    TEST_ASSERT(val != NULL && strcmp(val, "rewritten") == 0,
+                "overwrite must replace the single copy of the key.");
+  }
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_arena(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create_arena(64, 0, fnv1a, free);
+  TEST_ASSERT(map != NULL, "hashmap_create_arena should not return NULL.");
+
+  /* grow, shrink and regrow the buckets so freed arrays cycle through the
+   * arena free lists and get handed out again */
+  enum { NKEYS = 4000 };
+  char key[24];
+  int round = 0;
+  int i = 0;
+  for (round = 0; round < 3; round++) {
+    for (i = 0; i < NKEYS; i++) {
+      snprintf(key, sizeof(key), "arena_key_%d", i);
+      TEST_ASSERT(hashmap_set(map, key, strdup(key)),
+                  "hashmap_set should succeed.");
+    }
+    for (i = 0; i < NKEYS; i++) {
+      snprintf(key, sizeof(key), "arena_key_%d", i);
+      char *val = hashmap_get(map, key);
+      TEST_ASSERT(val != NULL && strcmp(val, key) == 0,
+                  "arena-backed map must behave like the regular one.");
+    }
+    /* leave a few keys in on the last round for destroy to clean up */
+    int keep = (round == 2) ? NKEYS / 4 : 0;
+    for (i = keep; i < NKEYS; i++) {
+      snprintf(key, sizeof(key), "arena_key_%d", i);
+      void *data = NULL;
+      TEST_ASSERT(hashmap_delete(map, key, &data),
+                  "delete should find every inserted key.");
+      free(data);
+    }
+  }
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_snapshot(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* snapshot values must be meaningful across processes, store integers */
+  HashMap *map = hashmap_create(32, fnv1a, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 1000 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "snap_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+
+  char path[] = "/tmp/hashmap-snapshot-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT(fd >= 0, "mkstemp should succeed.");
+  TEST_ASSERT(hashmap_save(map, fd), "hashmap_save should succeed.");
+  hashmap_destroy(map);
+
+  TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0, "lseek should succeed.");
+  map = hashmap_load(fd, fnv1a, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_load should succeed.");
+  close(fd);
+  unlink(path);
+
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "snap_key_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "loaded map must hold every saved key.");
+  }
+  /* a loaded map must stay fully mutable, including bucket growth out of
+   * the read-only mapping */
+  for (i = NKEYS; i < NKEYS * 2; i++) {
+    snprintf(key, sizeof(key), "snap_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "set on a loaded map should succeed.");
+  }
+  for (i = 0; i < NKEYS * 2; i += 2) {
+    snprintf(key, sizeof(key), "snap_key_%d", i);
+    void *data = NULL;
+    TEST_ASSERT(hashmap_delete(map, key, &data),
+                "delete on a loaded map should succeed.");
+    TEST_ASSERT(data == (void *)(intptr_t)(i + 1),
+                "deleted data should be handed back.");
+  }
+  for (i = 1; i < NKEYS * 2; i += 2) {
+    snprintf(key, sizeof(key), "snap_key_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "odd keys must survive the deletions.");
+  }
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+/* constant pkey (bucket 5), distinct skey: every key lands in one bucket
+ * without colliding, to steer bucket growth from the test */
+static uint64_t bucket5_hash(const char *key, size_t len) {
+  return (fnv1a(key, len) << 32) | 5;
+}
+
+static void test_create_ex(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMapConfig config = {.bucket_size = 8,
+                          .growth = 4,
+                          .load_factor = 0.75,
+                          .shrink_factor = 0.05};
+  HashMap *map = hashmap_create_ex(16, &config, bucket5_hash, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create_ex should not return NULL.");
+
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 20; i++) {
+    snprintf(key, sizeof(key), "ex_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  /* the capacity ladder differs when buckets start inline, only check the
+   * exact steps on the default layout */
+#if HASH_MAP_BUCKET_INLINE == 0
+  /* growth 4: one grow takes the bucket from 8 straight to 32 */
+  TEST_ASSERT(map->table[5].capacity == 32,
+              "bucket should quadruple on growth.");
+#endif
+
+  /* shrink hysteresis: 2 items in 32 slots is above 5%, no shrink yet */
+  size_t grown_capacity = map->table[5].capacity;
+  for (i = 19; i >= 2; i--) {
+    snprintf(key, sizeof(key), "ex_key_%d", i);
+    TEST_ASSERT(hashmap_delete(map, key, NULL), "delete should succeed.");
+  }
+#if HASH_MAP_BUCKET_INLINE == 0
+  TEST_ASSERT(map->table[5].capacity == grown_capacity,
+              "bucket must not shrink above the hysteresis threshold.");
+#endif
+  TEST_ASSERT(hashmap_delete(map, "ex_key_1", NULL),
+              "delete should succeed.");
+  TEST_ASSERT(map->table[5].capacity < grown_capacity,
+              "bucket should shrink once below the hysteresis threshold.");
+  TEST_ASSERT(hashmap_get(map, "ex_key_0") == (void *)(intptr_t)1,
+              "remaining key must survive the shrink.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_set_bulk(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(64, fnv1a, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  /* warm the map up so bulk loading also extends non-empty buckets */
+  enum { NWARM = 100, NKEYS = 5000 };
+  static char keybuf[NKEYS][24];
+  const char *keys[NKEYS];
+  void *values[NKEYS];
+  int i = 0;
+  for (i = 0; i < NWARM; i++) {
+    snprintf(keybuf[i], sizeof(keybuf[i]), "bulk_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, keybuf[i], (void *)(intptr_t)-1),
+                "hashmap_set should succeed.");
+  }
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(keybuf[i], sizeof(keybuf[i]), "bulk_key_%d", i);
+    keys[i] = keybuf[i];
+    values[i] = (void *)(intptr_t)(i + 1);
+  }
+  TEST_ASSERT(hashmap_set_bulk(map, keys, values, NKEYS),
+              "hashmap_set_bulk should succeed.");
+  for (i = 0; i < NKEYS; i++) {
+    TEST_ASSERT(hashmap_get(map, keys[i]) == (void *)(intptr_t)(i + 1),
+                "bulk load must insert (and overwrite) every key.");
+  }
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_set_batch(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* a small table forces long per-bucket runs inside every window */
+  HashMap *map = hashmap_create(16, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 1000 };
+  static char keybuf[NKEYS][24];
+  const char *keys[NKEYS];
+  size_t lens[NKEYS];
+  void *values[NKEYS];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(keybuf[i], sizeof(keybuf[i]), "batch_%d", i);
+    keys[i] = keybuf[i];
+    lens[i] = strlen(keybuf[i]);
+    values[i] = (void *)(intptr_t)(i + 1);
+  }
+  TEST_ASSERT(hashmap_set_batch(map, keys, lens, values, NKEYS),
+              "hashmap_set_batch should succeed.");
+  TEST_ASSERT(hashmap_count(map) == NKEYS,
+              "every key of the batch was inserted.");
+  for (i = 0; i < NKEYS; i++) {
+    TEST_ASSERT(hashmap_get(map, keys[i]) == values[i],
+                "every batched key must be readable.");
+  }
+
+  /* a second batch overwrites; NULL lens falls back to strlen */
+  for (i = 0; i < NKEYS; i++) {
+    values[i] = (void *)(intptr_t)(i + 1001);
+  }
+  TEST_ASSERT(hashmap_set_batch(map, keys, NULL, values, NKEYS),
+              "a batch of overwrites should succeed.");
+  TEST_ASSERT(hashmap_count(map) == NKEYS, "overwrites add no items.");
+  for (i = 0; i < NKEYS; i++) {
+    TEST_ASSERT(hashmap_get(map, keys[i]) == values[i],
+                "overwritten values must be visible.");
+  }
+
+  /* duplicates within one window: the last value wins */
+  const char *dup_keys[3] = {"dup", "dup", "dup"};
+  void *dup_values[3] = {(void *)(intptr_t)1, (void *)(intptr_t)2,
+                         (void *)(intptr_t)3};
+  TEST_ASSERT(hashmap_set_batch(map, dup_keys, NULL, dup_values, 3),
+              "a batch with duplicate keys should succeed.");
+  TEST_ASSERT(hashmap_get(map, "dup") == (void *)(intptr_t)3,
+              "the last duplicate wins.");
+  TEST_ASSERT(hashmap_count(map) == NKEYS + 1,
+              "duplicates count as one item.");
+  hashmap_destroy(map);
+
+  /* a striped-lock map takes one lock per touched bucket per window */
+  map = hashmap_create_concurrent(16, 4, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create_concurrent should succeed.");
+  for (i = 0; i < NKEYS; i++) {
+    values[i] = (void *)(intptr_t)(i + 1);
+  }
+  TEST_ASSERT(hashmap_set_batch(map, keys, lens, values, NKEYS),
+              "batch insert should work on a concurrent map.");
+  for (i = 0; i < NKEYS; i++) {
+    TEST_ASSERT(hashmap_get(map, keys[i]) == values[i],
+                "every batched key must be readable under locks.");
+  }
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_builtin_hash(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* NULL hash function selects the built-in hash */
+  HashMap *map = hashmap_create(64, NULL, free);
+  TEST_ASSERT(map != NULL, "hashmap_create should accept a NULL hash.");
+
+  /* cover every built-in length path: 1-3 bytes, the 4..16 short path and
+   * the long loops */
+  enum { NKEYS = 500 };
+  char key[128];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    int pad = i % 120;
+    snprintf(key, sizeof(key), "%0*d", pad > 0 ? pad : 1, i);
+    TEST_ASSERT(hashmap_set(map, key, strdup(key)),
+                "hashmap_set should succeed.");
+  }
+  for (i = 0; i < NKEYS; i++) {
+    int pad = i % 120;
+    snprintf(key, sizeof(key), "%0*d", pad > 0 ? pad : 1, i);
+    char *val = hashmap_get(map, key);
+    TEST_ASSERT(val != NULL && strcmp(val, key) == 0,
+                "built-in hash must find every key.");
+  }
+  /* precomputed keys must agree with the string path too */
+  HashMapBucketKey ukey = hashmap_hash(map, "builtin", strlen("builtin"));
+  TEST_ASSERT(hashmap_set_hashed(map, ukey, strdup("builtin")),
+              "hashmap_set_hashed should succeed.");
+  TEST_ASSERT(strcmp(hashmap_get(map, "builtin"), "builtin") == 0,
+              "string get should agree with the hashed path.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_length_variants(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(64, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  /* binary keys with embedded NULs, impossible through the string API */
+  char uuid_a[16] = {0x00, 0x11, 0x00, 0x33, 0x44, 0x00, 0x66, 0x77,
+                     0x00, 0x99, 0xaa, 0x00, 0xcc, 0xdd, 0x00, 0xff};
+  char uuid_b[16] = {0x00, 0x11, 0x00, 0x33, 0x44, 0x00, 0x66, 0x77,
+                     0x00, 0x99, 0xaa, 0x00, 0xcc, 0xdd, 0x00, 0xfe};
+  TEST_ASSERT(hashmap_set_n(map, uuid_a, sizeof(uuid_a), "a"),
+              "hashmap_set_n should succeed.");
+  TEST_ASSERT(hashmap_set_n(map, uuid_b, sizeof(uuid_b), "b"),
+              "hashmap_set_n should succeed.");
+  TEST_ASSERT(strcmp(hashmap_get_n(map, uuid_a, sizeof(uuid_a)), "a") == 0,
+              "hashmap_get_n should find binary keys.");
+  TEST_ASSERT(strcmp(hashmap_get_n(map, uuid_b, sizeof(uuid_b)), "b") == 0,
+              "keys differing in their last byte must stay distinct.");
+
+  /* the string functions must agree with their _n counterparts */
+  TEST_ASSERT(hashmap_set_n(map, "plain", strlen("plain"), "value"),
+              "hashmap_set_n should succeed.");
+  TEST_ASSERT(strcmp(hashmap_get(map, "plain"), "value") == 0,
+              "string get should agree with the _n path.");
+  void *data = NULL;
+  TEST_ASSERT(hashmap_delete_n(map, uuid_a, sizeof(uuid_a), &data),
+              "hashmap_delete_n should find the key.");
+  TEST_ASSERT(strcmp(data, "a") == 0, "deleted data should be handed back.");
+  TEST_ASSERT(hashmap_get_n(map, uuid_a, sizeof(uuid_a)) == NULL,
+              "key should be gone after delete.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_iterator(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(32, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 1500 };
+  static int seen[NKEYS];
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "iter_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, &seen[i]),
+                "hashmap_set should succeed.");
+  }
+
+  /* resume the traversal in bounded slices across \"ticks\" */
+  HashMapIter it = hashmap_iter(map);
+  HashMapBucketKey ukey;
+  void *data = NULL;
+  size_t produced = 0;
+  for (;;) {
+    size_t slice = 0;
+    while (slice < 97 && hashmap_iter_next(&it, &ukey, &data)) {
+      (*(int *)data)++;
+      produced++;
+      slice++;
+    }
+    if (slice < 97) {
+      break;
+    }
+  }
+  TEST_ASSERT(produced == NKEYS, "iterator must produce every item.");
+  for (i = 0; i < NKEYS; i++) {
+    TEST_ASSERT(seen[i] == 1, "iterator must visit each item exactly once.");
+  }
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_inline_values(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create_inline(16, NULL, sizeof(uint64_t));
+  TEST_ASSERT(map != NULL, "hashmap_create_inline should not return NULL.");
+
+  enum { NKEYS = 400 };
+  char key[24];
+  uint64_t value = 0;
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "counter_%d", i);
+    value = (uint64_t)i; /* includes 0, a valid inline value */
+    TEST_ASSERT(hashmap_set_inline(map, key, &value),
+                "hashmap_set_inline should succeed.");
+  }
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "counter_%d", i);
+    value = 0xdeadbeef;
+    TEST_ASSERT(hashmap_get_inline(map, key, &value),
+                "hashmap_get_inline should find the key.");
+    TEST_ASSERT(value == (uint64_t)i,
+                "the value bytes must round-trip, including zero.");
+  }
+  TEST_ASSERT(!hashmap_get_inline(map, "counter_nope", &value),
+              "a missing key reports false, not a zero value.");
+
+  /* update in place: the classic counter increment */
+  TEST_ASSERT(hashmap_get_inline(map, "counter_7", &value),
+              "hashmap_get_inline should find the key.");
+  value++;
+  TEST_ASSERT(hashmap_set_inline(map, "counter_7", &value),
+              "hashmap_set_inline should succeed.");
+  TEST_ASSERT(hashmap_get_inline(map, "counter_7", &value) && value == 8,
+              "an updated value must read back.");
+
+  TEST_ASSERT(hashmap_delete(map, "counter_0", NULL),
+              "hashmap_delete should find the key.");
+  TEST_ASSERT(!hashmap_get_inline(map, "counter_0", &value),
+              "a deleted key is gone even when its value was zero.");
+  TEST_ASSERT(hashmap_count(map) == NKEYS - 1,
+              "hashmap_count must track inline items too.");
+
+  hashmap_destroy(map);
+
+  /* a narrower value_size only touches that many bytes */
+  map = hashmap_create_inline(16, NULL, sizeof(uint16_t));
+  TEST_ASSERT(map != NULL, "hashmap_create_inline should not return NULL.");
+  uint16_t small = 0x1234;
+  TEST_ASSERT(hashmap_set_inline(map, "small", &small),
+              "hashmap_set_inline should succeed.");
+  uint16_t small_out = 0;
+  TEST_ASSERT(hashmap_get_inline(map, "small", &small_out) &&
+                  small_out == 0x1234,
+              "a 2-byte value must round-trip.");
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void *_upsert_count_calls(void *old, void *ctx) {
+  /* +1 on a fresh insert, +2 when the stored value is handed back */
+  *(int *)ctx += old == NULL ? 1 : 2;
+  return old == NULL ? ctx : old;
+}
+
+static void *_upsert_increment(void *old, void *ctx) {
+  (void)ctx;
+  return (void *)((uintptr_t)old + 1);
+}
+
+static void test_upsert(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(16, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  int calls = 0;
+  TEST_ASSERT(hashmap_upsert(map, "upsert_key", _upsert_count_calls, &calls),
+              "hashmap_upsert should succeed.");
+  TEST_ASSERT(calls == 1, "compute runs once per upsert.");
+  TEST_ASSERT(hashmap_get(map, "upsert_key") == &calls,
+              "a fresh upsert stores the computed value.");
+  TEST_ASSERT(hashmap_upsert(map, "upsert_key", _upsert_count_calls, &calls),
+              "hashmap_upsert should succeed.");
+  TEST_ASSERT(calls == 3, "compute sees the stored value the second time.");
+  hashmap_destroy(map);
+
+  /* the counter pattern: one probe per increment on an inline-value map */
+  map = hashmap_create_inline(16, NULL, sizeof(uintptr_t));
+  TEST_ASSERT(map != NULL, "hashmap_create_inline should not return NULL.");
+  int i = 0;
+  for (i = 0; i < 1000; i++) {
+    TEST_ASSERT(hashmap_upsert(map, "hits", _upsert_increment, NULL),
+                "hashmap_upsert should succeed.");
+  }
+  uintptr_t hits = 0;
+  TEST_ASSERT(hashmap_get_inline(map, "hits", &hits) && hits == 1000,
+              "1000 upserts must count to 1000.");
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_entry(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* capacity 1: every key lands in the same bucket, so inserting enough
+   * keys is guaranteed to grow it under the handle */
+  HashMap *map = hashmap_create(1, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  int a = 0, b = 0, c = 0;
+  TEST_ASSERT(hashmap_set(map, "entry_key", &a), "hashmap_set should succeed.");
+  HashMapEntry entry = hashmap_find(map, "entry_key");
+  TEST_ASSERT(hashmap_entry_value(&entry) == &a,
+              "the handle must resolve to the stored value.");
+  TEST_ASSERT(hashmap_entry_set(&entry, &b),
+              "hashmap_entry_set should succeed.");
+  TEST_ASSERT(hashmap_get(map, "entry_key") == &b,
+              "an entry_set write is visible through hashmap_get.");
+
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 200; i++) {
+    snprintf(key, sizeof(key), "filler_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, &a), "hashmap_set should succeed.");
+  }
+  /* the bucket grew and moved every slot, the stale handle must re-probe */
+  TEST_ASSERT(hashmap_entry_value(&entry) == &b,
+              "a stale handle silently re-probes.");
+
+  TEST_ASSERT(hashmap_delete(map, "entry_key", NULL),
+              "hashmap_delete should find the key.");
+  TEST_ASSERT(hashmap_entry_value(&entry) == NULL,
+              "a handle onto a deleted key reads NULL.");
+  TEST_ASSERT(hashmap_entry_set(&entry, &c),
+              "entry_set re-inserts a vanished key.");
+  TEST_ASSERT(hashmap_get(map, "entry_key") == &c,
+              "the re-inserted value is visible through hashmap_get.");
+
+  /* a handle can be taken before the key exists */
+  HashMapEntry fresh = hashmap_find(map, "entry_fresh");
+  TEST_ASSERT(hashmap_entry_value(&fresh) == NULL,
+              "a handle onto a missing key reads NULL.");
+  TEST_ASSERT(hashmap_entry_set(&fresh, &a),
+              "entry_set inserts through a fresh handle.");
+  TEST_ASSERT(hashmap_entry_value(&fresh) == &a,
+              "the inserted value reads back through the handle.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_compact(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* capacity 1: every key lands in the same bucket */
+  HashMap *map = hashmap_create(1, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 160, NDEL = 70 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "tomb_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, &i), "hashmap_set should succeed.");
+  }
+  for (i = 0; i < NDEL; i++) {
+    snprintf(key, sizeof(key), "tomb_key_%d", i);
+    TEST_ASSERT(hashmap_delete(map, key, NULL),
+                "hashmap_delete should find the key.");
+  }
+  /* deletes only left tombstones, the surviving keys probe through them */
+  TEST_ASSERT(map->table[0].tombs == NDEL,
+              "every delete must leave a tombstone.");
+  for (i = NDEL; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "tomb_key_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == &i,
+                "keys behind tombstones must stay reachable.");
+  }
+
+  /* re-inserting a deleted key reuses its tombstone */
+  size_t tombs = map->table[0].tombs;
+  TEST_ASSERT(hashmap_set(map, "tomb_key_0", &i),
+              "hashmap_set should succeed.");
+  TEST_ASSERT(map->table[0].tombs == tombs - 1,
+              "an insert must reuse a tombstone of its probe chain.");
+  TEST_ASSERT(hashmap_delete(map, "tomb_key_0", NULL),
+              "hashmap_delete should find the key.");
+
+  TEST_ASSERT(hashmap_compact(map) == 1,
+              "the churned bucket exceeds the tombstone ratio.");
+  TEST_ASSERT(map->table[0].tombs == 0,
+              "compaction reclaims every tombstone.");
+  TEST_ASSERT(hashmap_compact(map) == 0,
+              "a compacted map has nothing left to rewrite.");
+  for (i = NDEL; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "tomb_key_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == &i,
+                "compaction must not lose items.");
+  }
+  TEST_ASSERT(hashmap_count(map) == NKEYS - NDEL,
+              "the live count is unchanged by compaction.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static int _expiry_freed = 0;
+
+static void _expiry_free(void *data) {
+  (void)data;
+  _expiry_freed++;
+}
+
+static void test_expiry(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create_expiring(16, NULL, _expiry_free);
+  TEST_ASSERT(map != NULL, "hashmap_create_expiring should not return NULL.");
+
+  static char payload[8];
+  TEST_ASSERT(hashmap_set_ttl(map, "short_lived", payload, 40),
+              "hashmap_set_ttl should succeed.");
+  TEST_ASSERT(hashmap_set_ttl(map, "long_lived", payload, 0),
+              "hashmap_set_ttl should succeed.");
+  TEST_ASSERT(hashmap_get(map, "short_lived") == payload,
+              "an item is visible before its deadline.");
+
+  usleep(80 * 1000);
+  TEST_ASSERT(hashmap_get(map, "short_lived") == NULL,
+              "an item past its deadline is absent.");
+  TEST_ASSERT(_expiry_freed == 1,
+              "the probe that found it expired must free_item it.");
+  TEST_ASSERT(hashmap_count(map) == 1,
+              "lazy reclaim must fix the item count.");
+  TEST_ASSERT(hashmap_get(map, "long_lived") == payload,
+              "ttl 0 never expires.");
+
+  /* cold buckets are reclaimed by the background sweep, not by probes */
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 50; i++) {
+    snprintf(key, sizeof(key), "cold_%d", i);
+    TEST_ASSERT(hashmap_set_ttl(map, key, payload, 40),
+                "hashmap_set_ttl should succeed.");
+  }
+  usleep(80 * 1000);
+  size_t evicted = 0;
+  /* 4-bucket slices cover the whole 16-bucket table in 4 calls */
+  for (i = 0; i < 4; i++) {
+    evicted += hashmap_evict_expired(map, 4);
+  }
+  TEST_ASSERT(evicted == 50, "the incremental sweep evicts every expired item.");
+  TEST_ASSERT(_expiry_freed == 51, "eviction goes through free_item.");
+  TEST_ASSERT(hashmap_count(map) == 1, "only the item without TTL survives.");
+
+  /* overwriting an expired key reuses its slot cleanly */
+  TEST_ASSERT(hashmap_set_ttl(map, "short_lived", payload, 40),
+              "hashmap_set_ttl should succeed.");
+  TEST_ASSERT(hashmap_get(map, "short_lived") == payload,
+              "a re-inserted key is visible again.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_stats(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(64, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+  TEST_ASSERT(hashmap_count(map) == 0, "a fresh map holds no items.");
+
+  enum { NKEYS = 600 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "stats_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)&key),
+                "hashmap_set should succeed.");
+  }
+  TEST_ASSERT(hashmap_count(map) == NKEYS,
+              "hashmap_count must track insertions.");
+
+  for (i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "stats_key_%d", i);
+    TEST_ASSERT(hashmap_delete(map, key, NULL),
+                "hashmap_delete should find the key.");
+  }
+  TEST_ASSERT(hashmap_count(map) == NKEYS - 100,
+              "hashmap_count must track deletions.");
+
+  HashMapStats stats;
+  hashmap_stats(map, &stats);
+  TEST_ASSERT(stats.count == NKEYS - 100,
+              "stats.count must match the live item count.");
+  TEST_ASSERT(stats.buckets == 64, "capacity is rounded to a power of two.");
+  size_t histogram_total = 0;
+  for (i = 0; i <= HASH_MAP_STATS_BINS; i++) {
+    histogram_total += stats.occupancy_histogram[i];
+  }
+  TEST_ASSERT(histogram_total == stats.buckets,
+              "every bucket lands in exactly one histogram bin.");
+  TEST_ASSERT(stats.empty_ratio >= 0.0 && stats.empty_ratio <= 1.0,
+              "empty_ratio is a ratio.");
+  TEST_ASSERT(stats.max_bucket_count >= 1,
+              "a non-empty map has a non-empty bucket.");
+  TEST_ASSERT(stats.max_probe_length >= 1,
+              "a stored item probes at least once.");
+  TEST_ASSERT(stats.mean_probe_length >= 1.0 &&
+                  stats.mean_probe_length <= (double)stats.max_probe_length,
+              "mean probe length sits between 1 and the max.");
+  TEST_ASSERT(stats.allocated_bytes > 0,
+              "grown buckets account for heap bytes.");
+
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static uint64_t _seeded_calls = 0;
+
+static uint64_t seeded_fnv1a(const char *key, size_t len, uint64_t seed) {
+  _seeded_calls++;
+  return fnv1a(key, len) ^ seed;
+}
+
+static void test_seeded_hash(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* two maps with different seeds must place the same key differently,
+   * otherwise the seed buys no flooding protection */
+  HashMapConfig config_a = {.seed = 0x1234567890abcdefULL};
+  HashMapConfig config_b = {.seed = 0xfedcba0987654321ULL};
+  HashMap *map_a = hashmap_create_ex(64, &config_a, NULL, NULL);
+  HashMap *map_b = hashmap_create_ex(64, &config_b, NULL, NULL);
+  HashMap *plain = hashmap_create(64, NULL, NULL);
+  TEST_ASSERT(map_a != NULL && map_b != NULL && plain != NULL,
+              "creates should not return NULL.");
+
+  HashMapBucketKey ka = hashmap_hash(map_a, "seed_key", 8);
+  HashMapBucketKey kb = hashmap_hash(map_b, "seed_key", 8);
+  HashMapBucketKey kp = hashmap_hash(plain, "seed_key", 8);
+  TEST_ASSERT(ka.pkey != kb.pkey || ka.skey != kb.skey,
+              "different seeds should scatter the same key.");
+  /* seed 0 keeps the historical built-in output, snapshots from unseeded
+   * maps stay valid */
+  TEST_ASSERT(kp.pkey != ka.pkey || kp.skey != ka.skey,
+              "a seeded map should not hash like an unseeded one.");
+
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 200; i++) {
+    snprintf(key, sizeof(key), "seeded_%d", i);
+    TEST_ASSERT(hashmap_set(map_a, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  for (i = 0; i < 200; i++) {
+    snprintf(key, sizeof(key), "seeded_%d", i);
+    TEST_ASSERT(hashmap_get(map_a, key) == (void *)(intptr_t)(i + 1),
+                "hashmap_get should find every key.");
+  }
+  hashmap_destroy(map_a);
+  hashmap_destroy(map_b);
+  hashmap_destroy(plain);
+
+  /* random_seed draws a per-map seed at create */
+  HashMapConfig random_config = {.random_seed = true};
+  map_a = hashmap_create_ex(64, &random_config, NULL, NULL);
+  TEST_ASSERT(map_a != NULL, "hashmap_create_ex should not return NULL.");
+  TEST_ASSERT(map_a->seed != 0, "a random seed should be drawn.");
+  TEST_ASSERT(hashmap_set(map_a, "random_key", (void *)(intptr_t)7),
+              "set on a random-seed map should succeed.");
+  TEST_ASSERT(hashmap_get(map_a, "random_key") == (void *)(intptr_t)7,
+              "get on a random-seed map should succeed.");
+  hashmap_destroy(map_a);
+
+  /* a custom seeded hash receives the per-map seed */
+  HashMapConfig seeded_config = {.seed = 42, .seeded_hash = seeded_fnv1a};
+  map_a = hashmap_create_ex(64, &seeded_config, NULL, NULL);
+  TEST_ASSERT(map_a != NULL, "hashmap_create_ex should not return NULL.");
+  TEST_ASSERT(hashmap_set(map_a, "custom_key", (void *)(intptr_t)9),
+              "set through a seeded hash should succeed.");
+  TEST_ASSERT(hashmap_get(map_a, "custom_key") == (void *)(intptr_t)9,
+              "get through a seeded hash should succeed.");
+  TEST_ASSERT(_seeded_calls > 0, "the seeded hash should have been called.");
+  hashmap_destroy(map_a);
+
+  /* the seed travels with a snapshot, lookups work after load */
+  HashMapConfig snap_config = {.seed = 0xdeadbeefcafef00dULL};
+  map_a = hashmap_create_ex(32, &snap_config, NULL, NULL);
+  TEST_ASSERT(map_a != NULL, "hashmap_create_ex should not return NULL.");
+  for (i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "seedsnap_%d", i);
+    TEST_ASSERT(hashmap_set(map_a, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  char path[] = "/tmp/hashmap-seedsnap-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT(fd >= 0, "mkstemp should succeed.");
+  TEST_ASSERT(hashmap_save(map_a, fd), "hashmap_save should succeed.");
+  hashmap_destroy(map_a);
+  TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0, "lseek should succeed.");
+  map_a = hashmap_load(fd, NULL, NULL);
+  TEST_ASSERT(map_a != NULL, "hashmap_load should succeed.");
+  close(fd);
+  unlink(path);
+  TEST_ASSERT(map_a->seed == 0xdeadbeefcafef00dULL,
+              "the seed should be restored from the snapshot.");
+  for (i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "seedsnap_%d", i);
+    TEST_ASSERT(hashmap_get(map_a, key) == (void *)(intptr_t)(i + 1),
+                "loaded seeded map must hold every saved key.");
+  }
+  hashmap_destroy(map_a);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_overload_detector(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* bucket5_hash pins every key to bucket 5: maximal skew, exactly the
+   * shape a collision flood produces */
+  HashMap *map = hashmap_create(16, bucket5_hash, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 40; i++) {
+    snprintf(key, sizeof(key), "flood_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  HashMapStats stats;
+  hashmap_stats(map, &stats);
+  /* mean is 2.5 items per bucket, bucket 5 holds 40 > 8 * 2.5 */
+  TEST_ASSERT(stats.overloaded_buckets == 1,
+              "the flooded bucket should be flagged.");
+  hashmap_destroy(map);
+
+  /* a healthy hash spreading the same keys should not trip the alarm */
+  map = hashmap_create(16, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+  for (i = 0; i < 40; i++) {
+    snprintf(key, sizeof(key), "flood_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  hashmap_stats(map, &stats);
+  TEST_ASSERT(stats.overloaded_buckets == 0,
+              "a balanced map should flag nothing.");
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_placement(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* whether the kernel actually serves hugepages or honours the NUMA hint
+   * cannot be asserted portably, so this checks the mmap'd-map plumbing and
+   * that the map behaves identically on it */
+  HashMapConfig config = {.huge_pages = true, .numa_interleave = true};
+  HashMap *map = hashmap_create_ex(1024, &config, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create_ex should not return NULL.");
+  TEST_ASSERT(map->_map_size > 0 &&
+                  map->_map_size % ((size_t)2 * 1024 * 1024) == 0,
+              "map block is mmap'd and rounded to whole hugepages.");
+
+  char key[24];
+  int i = 0;
+  for (i = 0; i < 500; i++) {
+    snprintf(key, sizeof(key), "huge_key_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  for (i = 0; i < 500; i++) {
+    snprintf(key, sizeof(key), "huge_key_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "hashmap_get should find every key.");
+  }
+  for (i = 0; i < 500; i += 2) {
+    snprintf(key, sizeof(key), "huge_key_%d", i);
+    TEST_ASSERT(hashmap_delete(map, key, NULL), "delete should succeed.");
+  }
+  TEST_ASSERT(hashmap_count(map) == 250, "half the keys remain.");
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_clone(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(8, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 100 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "clone_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+
+  HashMap *snap = hashmap_clone(map);
+  TEST_ASSERT(snap != NULL, "hashmap_clone should not return NULL.");
+  TEST_ASSERT(hashmap_count(snap) == NKEYS,
+              "the clone holds every item of clone time.");
+#if HASH_MAP_BUCKET_INLINE == 0
+  TEST_ASSERT(map->table[0].shares != NULL &&
+                  map->table[0].shares == snap->table[0].shares,
+              "cloned buckets share their arrays through one refcount.");
+#endif
+
+  /* mutate the parent: the clone must keep the clone-time view */
+  TEST_ASSERT(hashmap_set(map, "clone_0", (void *)(intptr_t)999),
+              "overwrite in the parent should succeed.");
+  TEST_ASSERT(hashmap_delete(map, "clone_1", NULL),
+              "delete in the parent should succeed.");
+  TEST_ASSERT(hashmap_set(map, "clone_new", (void *)(intptr_t)777),
+              "insert in the parent should succeed.");
+  TEST_ASSERT(hashmap_get(snap, "clone_0") == (void *)(intptr_t)1,
+              "the clone still sees the old value.");
+  TEST_ASSERT(hashmap_get(snap, "clone_1") == (void *)(intptr_t)2,
+              "the clone still sees the deleted key.");
+  TEST_ASSERT(hashmap_get(snap, "clone_new") == NULL,
+              "the clone does not see later inserts.");
+  TEST_ASSERT(hashmap_get(map, "clone_0") == (void *)(intptr_t)999,
+              "the parent sees its own writes.");
+
+  /* mutate the clone: copy-on-write isolates the parent too */
+  TEST_ASSERT(hashmap_set(snap, "clone_2", (void *)(intptr_t)555),
+              "write to the clone should succeed.");
+  TEST_ASSERT(hashmap_get(map, "clone_2") == (void *)(intptr_t)3,
+              "a clone write must not leak into the parent.");
+
+  /* a second clone stacks another reference on still-shared buckets */
+  HashMap *snap2 = hashmap_clone(map);
+  TEST_ASSERT(snap2 != NULL, "hashmap_clone should not return NULL.");
+  TEST_ASSERT(hashmap_get(snap2, "clone_0") == (void *)(intptr_t)999,
+              "the second clone sees the parent's current state.");
+
+  /* destroying the parent first must leave both clones readable
+   * (clone_2 was overwritten in the clone above, start past it) */
+  hashmap_destroy(map);
+  for (i = 3; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "clone_%d", i);
+    TEST_ASSERT(hashmap_get(snap, key) == (void *)(intptr_t)(i + 1),
+                "the clone outlives the parent.");
+  }
+  TEST_ASSERT(hashmap_get(snap2, "clone_new") == (void *)(intptr_t)777,
+              "the second clone outlives the parent.");
+  hashmap_destroy(snap2);
+  hashmap_destroy(snap);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static void test_shrink_to_fit(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  HashMap *map = hashmap_create(16, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 2000 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "stf_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+  /* purge 80%: the per-delete hysteresis shrink stops well above the
+   * minimal capacity, leaving slack behind */
+  for (i = 0; i < NKEYS; i++) {
+    if (i % 5 != 0) {
+      snprintf(key, sizeof(key), "stf_%d", i);
+      TEST_ASSERT(hashmap_delete(map, key, NULL),
+                  "hashmap_delete should succeed.");
+    }
+  }
+
+  HashMapStats stats;
+  hashmap_stats(map, &stats);
+  TEST_ASSERT(stats.slack_bytes > 0, "the purge left reclaimable slack.");
+  size_t before = stats.allocated_bytes;
+
+  size_t reclaimed = hashmap_shrink_to_fit(map);
+  TEST_ASSERT(reclaimed == stats.slack_bytes,
+              "the shrink reclaims exactly the reported slack.");
+  hashmap_stats(map, &stats);
+  TEST_ASSERT(stats.slack_bytes == 0, "no slack remains after the shrink.");
+  TEST_ASSERT(stats.allocated_bytes == before - reclaimed,
+              "the footprint dropped by the reclaimed amount.");
+
+  /* the survivors are untouched and the map keeps working */
+  TEST_ASSERT(hashmap_count(map) == NKEYS / 5,
+              "the item count is unchanged.");
+  for (i = 0; i < NKEYS; i += 5) {
+    snprintf(key, sizeof(key), "stf_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "every survivor is still reachable.");
+  }
+  /* an already-tight map has nothing to give back */
+  TEST_ASSERT(hashmap_shrink_to_fit(map) == 0,
+              "a second shrink finds nothing to reclaim.");
+
+  for (i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "stf_new_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "inserting after a shrink regrows buckets normally.");
+  }
+  for (i = 0; i < 100; i++) {
+    snprintf(key, sizeof(key), "stf_new_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "post-shrink inserts are readable.");
+  }
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+static size_t _extend_seen = 0;
+
+static void _extend_count_cb(HashMapBucketKey key, void *data) {
+  (void)key;
+  (void)data;
+  _extend_seen++;
+}
+
+static void test_extend(void) {
+  printf("Running: %s\n", __FUNCTION__);
+  /* deliberately undersized primary table: 2000 keys over 16 buckets */
+  HashMap *map = hashmap_create(16, NULL, NULL);
+  TEST_ASSERT(map != NULL, "hashmap_create should not return NULL.");
+
+  enum { NKEYS = 2000 };
+  char key[24];
+  int i = 0;
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "ext_%d", i);
+    TEST_ASSERT(hashmap_set(map, key, (void *)(intptr_t)(i + 1)),
+                "hashmap_set should succeed.");
+  }
+
+  TEST_ASSERT(hashmap_extend(map, 256), "hashmap_extend should start.");
+  TEST_ASSERT(map->ext_table != NULL, "an extension is now in progress.");
+  TEST_ASSERT(!hashmap_extend(map, 512),
+              "a second extension cannot start while one runs.");
+
+  /* a handful of operations moves the cursor but leaves both tables live;
+   * lookups must be right mid-migration */
+  for (i = 0; i < 4; i++) {
+    snprintf(key, sizeof(key), "ext_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "hashmap_get should find every key mid-migration.");
+  }
+  TEST_ASSERT(map->ext_table != NULL && map->ext_pos > 0,
+              "the migration advanced but did not finish.");
+
+  /* mutations mid-migration land in whichever table owns the bucket */
+  TEST_ASSERT(hashmap_set(map, "ext_0", (void *)(intptr_t)111),
+              "overwrite mid-migration should succeed.");
+  TEST_ASSERT(hashmap_delete(map, "ext_1", NULL),
+              "delete mid-migration should succeed.");
+  TEST_ASSERT(hashmap_set(map, "ext_fresh", (void *)(intptr_t)222),
+              "insert mid-migration should succeed.");
+
+  _extend_seen = 0;
+  hashmap_iterate(map, _extend_count_cb);
+  TEST_ASSERT(_extend_seen == NKEYS, "iteration covers both tables.");
+  HashMapStats stats;
+  hashmap_stats(map, &stats);
+  TEST_ASSERT(stats.count == NKEYS, "stats cover both tables.");
+
+  /* enough operations finish the migration and swap the tables */
+  for (i = 0; i < 64; i++) {
+    snprintf(key, sizeof(key), "ext_%d", 100 + i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(101 + i),
+                "hashmap_get should keep finding keys.");
+  }
+  TEST_ASSERT(map->ext_table == NULL, "the extension completed.");
+  TEST_ASSERT(map->capacity == 256, "the primary capacity grew online.");
+
+  TEST_ASSERT(hashmap_get(map, "ext_0") == (void *)(intptr_t)111,
+              "mid-migration overwrite survives the swap.");
+  TEST_ASSERT(hashmap_get(map, "ext_1") == NULL,
+              "mid-migration delete survives the swap.");
+  TEST_ASSERT(hashmap_get(map, "ext_fresh") == (void *)(intptr_t)222,
+              "mid-migration insert survives the swap.");
+  for (i = 2; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "ext_%d", i);
+    TEST_ASSERT(hashmap_get(map, key) == (void *)(intptr_t)(i + 1),
+                "every key survives the extension.");
+  }
+  TEST_ASSERT(hashmap_count(map) == NKEYS, "the item count is unchanged.");
+
+  /* extending to the current size or smaller is a no-op, not an error */
+  TEST_ASSERT(hashmap_extend(map, 64),
+              "a smaller target is already satisfied.");
+  TEST_ASSERT(map->ext_table == NULL, "no migration was started for it.");
+  hashmap_destroy(map);
+  printf("PASSED: %s\n\n", __FUNCTION__);
+}
+
+int main(void) {
+  test_hashed_variants();
+  test_get_batch();
+  test_verified_keys();
+  test_incremental();
+  test_arena();
+  test_snapshot();
+  test_set_bulk();
+  test_set_batch();
+  test_create_ex();
+  test_builtin_hash();
+  test_length_variants();
+  test_iterator();
+  test_stats();
+  test_inline_values();
+  test_upsert();
+  test_entry();
+  test_compact();
+  test_expiry();
+  test_placement();
+  test_seeded_hash();
+  test_overload_detector();
+  test_clone();
+  test_extend();
+  test_shrink_to_fit();
+  printf("--- api-test: all tests passed ---\n");
+  return EXIT_SUCCESS;
+}
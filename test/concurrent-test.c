@@ -0,0 +1,226 @@
+/**
+ * concurrent-test.c
+ *
+ * Exercises the striped-lock concurrent mode: several threads hammer
+ * disjoint and overlapping key ranges with set/get/delete and the result
+ * is checked against the expected final content.
+ *
+ * To compile and run (assuming you are in the root of the project):
+ * gcc -o test/concurrent-test test/concurrent-test.c src/hashmap.c -pthread
+ * ./test/concurrent-test
+ */
+#include "../src/include/hashmap.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_THREADS 8
+#define KEYS_PER_THREAD 5000
+
+/* FNV-1a, good enough for a test and keeps xxhash out of the deps */
+static uint64_t fnv1a(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+typedef struct {
+  HashMap *map;
+  int id;
+} ThreadArg;
+
+static void *worker(void *arg) {
+  ThreadArg *ta = arg;
+  char key[32];
+  int i = 0;
+  /* insert a private key range */
+  for (i = 0; i < KEYS_PER_THREAD; i++) {
+    snprintf(key, sizeof(key), "t%d_key_%d", ta->id, i);
+    if (!hashmap_set(ta->map, key, strdup(key))) {
+      fprintf(stderr, "set failed for %s\n", key);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* read everything back while other threads are still writing */
+  for (i = 0; i < KEYS_PER_THREAD; i++) {
+    snprintf(key, sizeof(key), "t%d_key_%d", ta->id, i);
+    char *val = hashmap_get(ta->map, key);
+    if (!val || strcmp(val, key) != 0) {
+      fprintf(stderr, "get mismatch for %s\n", key);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* delete the odd half */
+  for (i = 1; i < KEYS_PER_THREAD; i += 2) {
+    snprintf(key, sizeof(key), "t%d_key_%d", ta->id, i);
+    void *data = NULL;
+    if (!hashmap_delete(ta->map, key, &data)) {
+      fprintf(stderr, "delete failed for %s\n", key);
+      exit(EXIT_FAILURE);
+    }
+    free(data);
+  }
+  return NULL;
+}
+
+static size_t remaining = 0;
+static void count_item(HashMapBucketKey key, void *data) {
+  (void)key;
+  (void)data;
+  remaining++;
+}
+
+/* read-mostly phase: values are static strings so lock-free readers never
+ * race a free, which is the documented contract for hot values */
+static char stable_value[] = "stable";
+static volatile int readers_stop = 0;
+
+static void *rm_writer(void *arg) {
+  HashMap *map = arg;
+  char key[32];
+  int round = 0;
+  int i = 0;
+  for (round = 0; round < 50; round++) {
+    for (i = 0; i < 500; i++) {
+      snprintf(key, sizeof(key), "rm_key_%d", i);
+      if (!hashmap_set(map, key, stable_value)) {
+        fprintf(stderr, "read-mostly set failed for %s\n", key);
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (i = 1; i < 500; i += 2) {
+      snprintf(key, sizeof(key), "rm_key_%d", i);
+      hashmap_delete(map, key, NULL);
+    }
+  }
+  return NULL;
+}
+
+static void *rm_reader(void *arg) {
+  HashMap *map = arg;
+  char key[32];
+  int i = 0;
+  while (!readers_stop) {
+    for (i = 0; i < 500; i++) {
+      snprintf(key, sizeof(key), "rm_key_%d", i);
+      char *val = hashmap_get(map, key);
+      /* odd keys flicker, even keys must read the stable value or nothing
+       * (before the writer's first pass) */
+      if (val != NULL && val != stable_value) {
+        fprintf(stderr, "lock-free get returned garbage for %s\n", key);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void test_read_mostly(void) {
+  HashMap *map = hashmap_create_read_mostly(61, 0, fnv1a, NULL);
+  if (!map) {
+    fprintf(stderr, "hashmap_create_read_mostly failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t writer;
+  pthread_t readers[4];
+  int t = 0;
+  readers_stop = 0;
+  if (pthread_create(&writer, NULL, rm_writer, map) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  for (t = 0; t < 4; t++) {
+    if (pthread_create(&readers[t], NULL, rm_reader, map) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_join(writer, NULL);
+  readers_stop = 1;
+  for (t = 0; t < 4; t++) {
+    pthread_join(readers[t], NULL);
+  }
+
+  /* no reader in flight anymore, reclaim retired arrays */
+  hashmap_quiesce(map);
+
+  char key[32];
+  int i = 0;
+  for (i = 0; i < 500; i++) {
+    snprintf(key, sizeof(key), "rm_key_%d", i);
+    char *val = hashmap_get(map, key);
+    if (i % 2 == 0) {
+      if (val != stable_value) {
+        fprintf(stderr, "lost key %s after read-mostly churn\n", key);
+        exit(EXIT_FAILURE);
+      }
+    } else if (val != NULL) {
+      fprintf(stderr, "deleted key %s survived read-mostly churn\n", key);
+      exit(EXIT_FAILURE);
+    }
+  }
+  hashmap_destroy(map);
+  printf("concurrent-test: read-mostly checks passed\n");
+}
+
+int main(void) {
+  HashMap *map = hashmap_create_concurrent(1021, 0, fnv1a, free);
+  if (!map) {
+    fprintf(stderr, "hashmap_create_concurrent failed\n");
+    return EXIT_FAILURE;
+  }
+
+  pthread_t threads[NUM_THREADS];
+  ThreadArg args[NUM_THREADS];
+  int t = 0;
+  for (t = 0; t < NUM_THREADS; t++) {
+    args[t].map = map;
+    args[t].id = t;
+    if (pthread_create(&threads[t], NULL, worker, &args[t]) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      return EXIT_FAILURE;
+    }
+  }
+  for (t = 0; t < NUM_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  /* each thread kept the even half of its range */
+  hashmap_iterate(map, count_item);
+  size_t expected = (size_t)NUM_THREADS * ((KEYS_PER_THREAD + 1) / 2);
+  if (remaining != expected) {
+    fprintf(stderr, "expected %zu items, found %zu\n", expected, remaining);
+    return EXIT_FAILURE;
+  }
+
+  char key[32];
+  int i = 0;
+  for (t = 0; t < NUM_THREADS; t++) {
+    for (i = 0; i < KEYS_PER_THREAD; i++) {
+      snprintf(key, sizeof(key), "t%d_key_%d", t, i);
+      char *val = hashmap_get(map, key);
+      if (i % 2 == 0) {
+        if (!val || strcmp(val, key) != 0) {
+          fprintf(stderr, "lost key %s\n", key);
+          return EXIT_FAILURE;
+        }
+      } else if (val != NULL) {
+        fprintf(stderr, "deleted key %s still present\n", key);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  hashmap_destroy(map);
+
+  test_read_mostly();
+
+  printf("concurrent-test: all checks passed\n");
+  return EXIT_SUCCESS;
+}